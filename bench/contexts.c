@@ -0,0 +1,131 @@
+/* Many contexts at once, one per thread, each checking it only ever sees its own state */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "flamingo.h"
+#include "type.h"
+#include "lib.h"
+
+#define MAX_THREADS 256
+
+/* every context computes something depending on its own `id`, and recovers from errors on the way */
+static const char *const workload =
+    "(set m (map-new)) (set i 0) (set acc 0)"
+    "(while (< i 20000) (map-set m i (* i id)) (set i (+ i 1)))"
+    "(set i 0)"
+    "(while (< i 20000) (set acc (+ acc (map-get m i))) (set i (+ i 1)))"
+    "(set acc (+ acc (fold + 0 (map (fn (x) (* x x)) (range 1000)))))"
+    "(set caught (try (fn () (first id))))"
+    "(set nested (try (fn () (if (= (try (fn () (rest id))) \"expected pair but got number\") id 0))))"
+    "(list acc (if (= caught \"expected pair but got number\") 1 0) nested id)";
+
+typedef struct {
+    int id, rounds;
+    bool ok;
+    char why[MAX_BUF_LEN * 2];
+} p_Job;
+
+typedef struct {
+    Fl_Object *fn, *res;
+    const char *src;
+} p_Call;
+
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char p_readstr(Fl_Context *ctx, void *data) {
+    const char **s = data;
+    M_unused(ctx);
+    return **s ? *(*s)++ : '\0';
+}
+
+static void p_call(Fl_Context *ctx, void *data) {
+    p_Call *c = data;
+    c->res = Fl_call(ctx, c->fn, NULL, 0);
+}
+
+/* (try f) - the value of (f), or the message of the error it raised */
+static Fl_Object *p_try(Fl_Context *ctx, Fl_Object *args) {
+    p_Call c = { .fn = Fl_next_arg(ctx, &args) };
+    return Fl_protect(ctx, p_call, &c) ? c.res : Fl_T_string(ctx, ctx->error);
+}
+
+static void p_eval_all(Fl_Context *ctx, void *data) {
+    p_Call *c = data;
+    int save = Fl_Gc_save(ctx);
+    for (Fl_Object *obj; (obj = Fl_read(ctx, p_readstr, &c->src)); Fl_Gc_restore(ctx, save))
+        c->res = Fl_eval(ctx, obj);
+    Fl_Gc_push(ctx, c->res);
+}
+
+static bool p_fail(p_Job *job, const char *why) {
+    snprintf(job->why, sizeof(job->why), "context %d: %s", job->id, why);
+    return job->ok = false;
+}
+
+static bool p_round(Fl_Context *ctx, p_Job *job) {
+    p_Call c = { .src = workload, .res = &nil };
+    if (!Fl_protect(ctx, p_eval_all, &c))
+        return p_fail(job, ctx->error);
+    Fl_Number expect[] = { job->id * (19999.0 * 20000 / 2) + 332833500.0, 1, job->id, job->id };
+    Fl_Object *l = c.res;
+    for (size_t i = 0; i < sizeof(expect) / sizeof(*expect); ++i, l = M_rest(l)) {
+        if (M_isnil(l) || Fl_type(ctx, M_first(l)) != T_NUMBER || Fl_to_number(ctx, M_first(l)) != expect[i])
+            return p_fail(job, "wrong result");
+    }
+    /* an error at the top, with nothing running */
+    c.src = "(first id)";
+    if (Fl_protect(ctx, p_eval_all, &c) || strcmp(ctx->error, "expected pair but got number"))
+        return p_fail(job, "error not recovered");
+    return true;
+}
+
+static void *p_thread(void *data) {
+    p_Job *job = data;
+    Fl_Context *ctx = Fl_open(0);
+    if (!ctx) {
+        p_fail(job, "could not allocate the interpreter");
+        return NULL;
+    }
+    bs_register_all(ctx);
+    Fl_set(ctx, Fl_T_symbol(ctx, "try"), Fl_T_cfunc(ctx, p_try));
+    Fl_set(ctx, Fl_T_symbol(ctx, "id"), Fl_T_number(ctx, job->id));
+    job->ok = true;
+    for (int r = 0; r < job->rounds && p_round(ctx, job); ++r)
+        ;
+    Fl_close(ctx);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 8, rounds = argc > 2 ? atoi(argv[2]) : 20;
+    if (n < 1 || n > MAX_THREADS || rounds < 1) {
+        fprintf(stderr, "Usage: %s [threads (1-%d)] [rounds]\n", *argv, MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+    static pthread_t threads[MAX_THREADS];
+    static p_Job jobs[MAX_THREADS];
+    double start = p_now();
+    for (int i = 0; i < n; ++i) {
+        jobs[i] = (p_Job){ .id = i + 1, .rounds = rounds };
+        if (pthread_create(&threads[i], NULL, p_thread, &jobs[i])) {
+            fputs("could not start a thread\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok) {
+            fprintf(stderr, "%s\n", jobs[i].why);
+            ++failed;
+        }
+    }
+    printf("%d contexts x %d rounds: %.1f ms, %d failed\n", n, rounds, (p_now() - start) * 1e3, failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
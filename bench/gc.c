@@ -0,0 +1,68 @@
+/* Arithmetic over a large live list, with the collector in each of its modes */
+
+#include <string.h>
+#include <time.h>
+
+#include "flamingo.h"
+#include "gc.h"
+
+static const char *const workload =
+    "(set keep nil) (set i 0)"
+    "(while (< i 300000) (set keep (cons (list i) keep)) (set i (+ i 1)))"
+    "(set round 0) (set acc 0)"
+    "(while (< round 4)"
+    "  (set c keep)"
+    "  (while c (set acc (+ acc (* 2 (first (first c))) 1)) (set c (rest c)))"
+    "  (set round (+ round 1)))";
+
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char p_readstr(Fl_Context *ctx, void *data) {
+    const char **s = data;
+    M_unused(ctx);
+    return **s ? *(*s)++ : '\0';
+}
+
+static void p_run(const char *name, bool generational, unsigned step_us) {
+    Fl_Context *ctx = Fl_open(0);
+    if (!ctx) {
+        fputs("malloc failure...\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    ctx->heap.generational = generational;
+    ctx->heap.step_us = step_us;
+    const char *src = workload;
+    int save = Fl_Gc_save(ctx);
+    double start = p_now();
+    for (Fl_Object *obj; (obj = Fl_read(ctx, p_readstr, &src)); Fl_Gc_restore(ctx, save))
+        Fl_eval(ctx, obj);
+    double total = p_now() - start;
+
+    Fl_Heap *heap = &ctx->heap;
+    unsigned long n = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+        n += heap->pauses[i];
+    printf("%-18s %8.1f ms total %8.1f ms gc %6lu minor %4lu full %7.3f ms mean pause %7.3f ms max pause"
+        " %7.3f ms max sweep\n", name, total * 1e3, (heap->pause_total + heap->sweep_total) * 1e3,
+        heap->collections[0], heap->collections[1], n ? heap->pause_total * 1e3 / n : 0.0,
+        heap->pause_max * 1e3, heap->sweep_max * 1e3);
+    printf("%18s", "pauses (us)");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+        if (heap->pauses[i])
+            printf(" %lu+: %lu", 1ul << i, heap->pauses[i]);
+    }
+    putchar('\n');
+    Fl_close(ctx);
+}
+
+int main(void) {
+    p_run("full only", false, 0);
+    p_run("generational", true, 0);
+    p_run("incremental 1ms", true, 1000);
+    p_run("incremental 200us", true, 200);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+/* A CPU-bound transform over a list with `map`, and with `pmap` from 1 to N threads */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flamingo.h"
+#include "lib.h"
+
+static const char *const setup =
+    "(set work (fn (x) (let i 0) (let acc x)"
+    "  (while (< i 2000) (set acc (/ (+ (* acc 31) i) 7)) (set i (+ i 1)))"
+    "  acc))"
+    "(set records (range 2000))";
+
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char p_readstr(Fl_Context *ctx, void *data) {
+    const char **s = data;
+    M_unused(ctx);
+    return **s ? *(*s)++ : '\0';
+}
+
+/* seconds `src` takes, the best of a few runs */
+static double p_time(Fl_Context *ctx, const char *src) {
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+        const char *s = src;
+        int save = Fl_Gc_save(ctx);
+        double start = p_now();
+        for (Fl_Object *obj; (obj = Fl_read(ctx, p_readstr, &s)); Fl_Gc_restore(ctx, save))
+            Fl_eval(ctx, obj);
+        double t = p_now() - start;
+        if (!run || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        fprintf(stderr, "Usage: %s [max threads]\n", *argv);
+        return EXIT_FAILURE;
+    }
+    Fl_Context *ctx = Fl_open(0);
+    if (!ctx) {
+        fputs("malloc failure...\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    bs_register_all(ctx);
+    p_time(ctx, setup);
+
+    double base = p_time(ctx, "(map work records)");
+    printf("%-12s %9.1f ms\n", "map", base * 1e3);
+    for (int threads = 1; threads <= n; threads *= 2) {
+        char src[MAX_BUF_LEN];
+        snprintf(src, sizeof(src), "(pmap work records %d)", threads);
+        double t = p_time(ctx, src);
+        printf("pmap %-2d thr %9.1f ms %6.2fx\n", threads, t * 1e3, base / t);
+        if (threads < n && threads * 2 > n)
+            threads = n / 2;
+    }
+    Fl_close(ctx);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/*
+ * The workloads in bench/suite, each run a number of times in a fresh context of its own, after the
+ * library is loaded. Median and 95th percentile wall time, cells allocated and collections are
+ * written as JSON, and compared with the medians of an earlier run if there is one
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flamingo.h"
+#include "lib.h"
+
+#ifndef FL_BENCH_DIR
+#define FL_BENCH_DIR "bench/suite"
+#endif
+#ifndef FL_BENCH_LIB
+#define FL_BENCH_LIB "lib"
+#endif
+
+#define BENCH_RUNS     10
+#define BENCH_MAX_RUNS 1000
+
+static const char *const workloads[] = { "recursion", "lists", "strings", "macros", "symbols", "gc" };
+
+/* what one run of a workload took */
+typedef struct {
+    double ms;
+    double allocated;
+    double minor, full;
+} p_Run;
+
+typedef struct {
+    char name[MAX_BUF_LEN];
+    double median, p95; /* ms */
+    double allocated, minor, full; /* medians */
+} p_Result;
+
+typedef struct {
+    const char *path;
+    p_Run *run;
+} p_Job;
+
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t p_allocated(Fl_Context *ctx, unsigned long collections[2]) {
+    Fl_Gc_Stats st;
+    size_t n = 0;
+    Fl_Gc_stats(ctx, &st);
+    for (int t = 0; t < FL_NTYPES; ++t)
+        n += st.allocated[t];
+    collections[0] = st.collections[0];
+    collections[1] = st.collections[1];
+    return n;
+}
+
+static void p_run_file(Fl_Context *ctx, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "could not open '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    Fl_run_file(ctx, fp);
+}
+
+static void p_job(Fl_Context *ctx, void *data) {
+    p_Job *job = data;
+    unsigned long before[2], after[2];
+    size_t allocated = p_allocated(ctx, before);
+    double start = p_now();
+    p_run_file(ctx, job->path);
+    job->run->ms = (p_now() - start) * 1e3;
+    job->run->allocated = p_allocated(ctx, after) - allocated;
+    job->run->minor = after[0] - before[0];
+    job->run->full = after[1] - before[1];
+}
+
+/* the workload at `path`, once, from a context with nothing but the library in it */
+static void p_run(const char *path, p_Run *run) {
+    Fl_Context *ctx = Fl_open(0);
+    if (!ctx) {
+        fputs("malloc failure...\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    p_run_file(ctx, FL_BENCH_LIB "/base.fl");
+    bs_register_all(ctx);
+    p_Job job = { path, run };
+    if (!Fl_protect(ctx, p_job, &job)) {
+        fprintf(stderr, "[error] %s: %s\n", path, ctx->error);
+        exit(EXIT_FAILURE);
+    }
+    Fl_close(ctx);
+}
+
+static int p_by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* percentile `p` of the `n` values in `v`, by nearest rank; sorts `v` */
+static double p_percentile(double *v, int n, double p) {
+    qsort(v, n, sizeof(*v), p_by_value);
+    int rank = (int)(p * n + 0.999999);
+    return v[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+/* the name of workload file `path`, without directory and extension */
+static void p_name(const char *path, char *name, size_t size) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t len = strcspn(base, ".");
+    snprintf(name, size, "%.*s", (int)(len < size ? len : size - 1), base);
+}
+
+static void p_measure(const char *path, int runs, p_Result *res) {
+    p_Run *run = calloc(runs + 1, sizeof(*run));
+    double *v = calloc(runs, sizeof(*v));
+    if (!run || !v) {
+        fputs("malloc failure...\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    p_name(path, res->name, sizeof(res->name));
+    /* the first run warms up caches and the allocator, it doesn't count */
+    for (int i = 0; i <= runs; ++i)
+        p_run(path, &run[i]);
+    for (int i = 0; i < runs; ++i)
+        v[i] = run[i + 1].ms;
+    res->median = p_percentile(v, runs, 0.5);
+    res->p95 = p_percentile(v, runs, 0.95);
+    for (int i = 0; i < runs; ++i)
+        v[i] = run[i + 1].allocated;
+    res->allocated = p_percentile(v, runs, 0.5);
+    for (int i = 0; i < runs; ++i)
+        v[i] = run[i + 1].minor;
+    res->minor = p_percentile(v, runs, 0.5);
+    for (int i = 0; i < runs; ++i)
+        v[i] = run[i + 1].full;
+    res->full = p_percentile(v, runs, 0.5);
+    free(run);
+    free(v);
+}
+
+static void p_write_json(FILE *fp, const p_Result *res, int n, int runs) {
+    fprintf(fp, "{\n  \"version\": \"%s\",\n  \"runs\": %d,\n  \"workloads\": [\n", FL_VERSION, runs);
+    for (int i = 0; i < n; ++i) {
+        fprintf(fp, "    {\"name\": \"%s\", \"median_ms\": %.3f, \"p95_ms\": %.3f, \"allocated\": %.0f, "
+            "\"minor_collections\": %.0f, \"full_collections\": %.0f}%s\n", res[i].name, res[i].median,
+            res[i].p95, res[i].allocated, res[i].minor, res[i].full, i + 1 < n ? "," : "");
+    }
+    fputs("  ]\n}\n", fp);
+}
+
+/* median of workload `name` in the JSON written by an earlier run, one workload a line; < 0 if missing */
+static double p_baseline(FILE *fp, const char *name) {
+    char line[512], key[MAX_BUF_LEN + 16];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        const char *at = strstr(line, "\"median_ms\": ");
+        if (strstr(line, key) && at)
+            return strtod(at + strlen("\"median_ms\": "), NULL);
+    }
+    return -1;
+}
+
+/* print how the medians changed since `path`, false if one got slower by more than `threshold` percent */
+static bool p_compare(const char *path, const p_Result *res, int n, double threshold) {
+    FILE *fp = fopen(path, "r");
+    bool ok = true;
+    if (!fp) {
+        fprintf(stderr, "could not open baseline '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "%-12s %12s %12s %9s\n", "workload", "baseline ms", "median ms", "change");
+    for (int i = 0; i < n; ++i) {
+        double base = p_baseline(fp, res[i].name);
+        if (base <= 0) {
+            fprintf(stderr, "%-12s %12s %12.3f\n", res[i].name, "-", res[i].median);
+            continue;
+        }
+        double change = (res[i].median - base) * 100 / base;
+        bool slower = threshold > 0 && change > threshold;
+        fprintf(stderr, "%-12s %12.3f %12.3f %+8.1f%%%s\n", res[i].name, base, res[i].median, change,
+            slower ? "  slower" : "");
+        ok = ok && !slower;
+    }
+    fclose(fp);
+    return ok;
+}
+
+__attribute__((noreturn)) static void p_usage(char **argv) {
+    fprintf(stderr, "Usage: %s [-n runs] [-o file] [-b baseline] [-t percent] [workload.fl ...]\n"
+        "  -n runs     runs of each workload, besides a warm-up one (default %d)\n"
+        "  -o file     write the results to 'file' instead of stdout\n"
+        "  -b file     compare the medians with those in 'file', written by an earlier run\n"
+        "  -t percent  with -b, fail if a median got slower by more than 'percent'\n"
+        "Without workloads, runs those in " FL_BENCH_DIR "\n", *argv, BENCH_RUNS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int runs = BENCH_RUNS, c;
+    const char *out = NULL, *baseline = NULL;
+    double threshold = 0;
+    while ((c = getopt(argc, argv, "n:o:b:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            p_usage(argv);
+        }
+    }
+    if (runs < 1 || runs > BENCH_MAX_RUNS)
+        p_usage(argv);
+
+    int n = optind < argc ? argc - optind : (int)(sizeof(workloads) / sizeof(*workloads));
+    p_Result *res = calloc(n, sizeof(*res));
+    if (!res) {
+        fputs("malloc failure...\n", stderr);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < n; ++i) {
+        char path[1024];
+        if (optind < argc)
+            snprintf(path, sizeof(path), "%s", argv[optind + i]);
+        else
+            snprintf(path, sizeof(path), "%s/%s.fl", FL_BENCH_DIR, workloads[i]);
+        p_measure(path, runs, &res[i]);
+        fprintf(stderr, "%-12s %9.3f ms median %9.3f ms p95\n", res[i].name, res[i].median, res[i].p95);
+    }
+
+    /* before writing, the baseline may be the file the results go to */
+    bool ok = !baseline || p_compare(baseline, res, n, threshold);
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "could not open '%s'\n", out);
+        return EXIT_FAILURE;
+    }
+    p_write_json(fp, res, n, runs);
+    if (out)
+        fclose(fp);
+    free(res);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
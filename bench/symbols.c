@@ -0,0 +1,47 @@
+/* Interns 100k distinct symbols and then looks each of them up again */
+
+#include <string.h>
+#include <time.h>
+
+#include "flamingo.h"
+#include "type.h"
+
+#define NSYMBOLS 100000
+
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    Fl_Context *ctx = Fl_open(0);
+    if (!ctx) {
+        fputs("malloc failure...\n", stderr);
+        return EXIT_FAILURE;
+    }
+    char name[MAX_BUF_LEN];
+    int save = Fl_Gc_save(ctx);
+
+    /* bind every symbol so the collector keeps it interned */
+    double start = p_now();
+    for (int i = 0; i < NSYMBOLS; ++i) {
+        snprintf(name, sizeof(name), "sym-%d", i);
+        Fl_set(ctx, Fl_T_symbol(ctx, name), ctx->t);
+        Fl_Gc_restore(ctx, save);
+    }
+    double intern = p_now() - start;
+
+    start = p_now();
+    for (int i = 0; i < NSYMBOLS; ++i) {
+        snprintf(name, sizeof(name), "sym-%d", i);
+        Fl_T_symbol(ctx, name);
+        Fl_Gc_restore(ctx, save);
+    }
+    double lookup = p_now() - start;
+
+    printf("intern %d symbols: %.3f ms\n", NSYMBOLS, intern * 1e3);
+    printf("lookup %d symbols: %.3f ms\n", NSYMBOLS, lookup * 1e3);
+    Fl_close(ctx);
+    return EXIT_SUCCESS;
+}
@@ -3,7 +3,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
 #include "config.h"
 
@@ -12,6 +14,14 @@
 
 #define MAX_BUF_LEN 64 /* a random but reasonable number */
 
+/* numbers are kept in the pointer itself where it's wide enough, see Fl_T_number */
+#if UINTPTR_MAX > 0xffffffffu
+#define FL_IMMEDIATES 1
+#else
+#define FL_IMMEDIATES 0
+#endif
+#define FL_IMM_ZERO ((uintptr_t)0x8000000000000002u) /* the slot of 0x3000000000000000, which is boxed */
+
 /* M_ prefix for all macro functions */
 
 #define M_unused(P)        ((void)(P)) /* just tells the compiler to ignore parameter P */
@@ -20,31 +30,133 @@
 #define M_rest(X)          ((X)->cdr.o)
 #define M_tag(X)           ((X)->car.c)
 #define M_isnil(X)         ((X) == &nil)
-#define M_type(X)          (M_isodd(M_tag(X)) ? M_tag(X) >> 2 : T_PAIR)
+#define M_isimm(X)         (FL_IMMEDIATES && ((uintptr_t)(X) & 3) == 2) /* a number, not a pointer */
+#define M_type(X)          (M_isimm(X) ? T_NUMBER : M_isodd(M_tag(X)) ? M_tag(X) >> 2 : T_PAIR)
 #define M_settype(X, T)    (M_tag(X) = (T) << 2 | 1)
-#define M_number(X)        ((X)->cdr.n)
+#define M_number(X)        (M_isimm(X) ? Fl_imm_number(X) : (X)->cdr.n)
 #define M_builtin(X)       ((X)->cdr.c)
 #define M_cfunc(X)         ((X)->cdr.f)
-#define M_strbuf(X)        (&(X)->car.c + 1)
+#define M_string(X)        ((Fl_String *)M_rest(X))
+#define M_vector(X)        ((Fl_Vector *)M_rest(X))
 
-#define STR_BUF_SIZE       ((int)sizeof(Fl_Object *) - 1)
-#define GC_MARKBIT         2
-#define GC_MAX_STACK_SIZE  256
+#define GC_STACK_SIZE      256 /* roots the gcstack first makes room for, it grows as needed */
+#define GC_MAX_STACK_SIZE  (1 << 22)
+#define MAX_NESTING        1024 /* lists the reader goes into, one in another */
+#define GC_PAUSE_BUCKETS   16
+#define OUT_BUF_SIZE       4096 /* output Fl_writefp gathers before handing it to stdio */
 
 typedef double Fl_Number;
 typedef struct Fl_Object Fl_Object;
 typedef struct Fl_Context Fl_Context;
+typedef struct Fl_Vm Fl_Vm;
+typedef struct Fl_Pool Fl_Pool;
+typedef struct Fl_Profile Fl_Profile;
+typedef struct Fl_Segment Fl_Segment;
 
 typedef Fl_Object *(*Fl_CFunc)(Fl_Context *ctx, Fl_Object *args);
 typedef void (*Fl_Error_fn)(Fl_Context *ctx, const char *err, Fl_Object *call_list);
 typedef void (*Fl_Write_fn)(Fl_Context *ctx, void *data, char c);
+typedef void (*Fl_Span_fn)(Fl_Context *ctx, void *data, const char *s, size_t len);
 typedef char (*Fl_Read_fn)(Fl_Context *ctx, void *data);
+typedef void (*Fl_Protected_fn)(Fl_Context *ctx, void *data);
+
+/* where the reader takes source text from, see reader.c */
+typedef struct {
+    const char *pos, *end; /* what's left of the buffer */
+    Fl_Read_fn fn; /* gives the characters one at a time when set, the buffer is then `c` */
+    void *data;
+    char c;
+    void *map; /* the file the buffer is a mapping of */
+    size_t map_len;
+} Fl_Reader;
+
+/* a file Fl_run_file is running, off the C stack so that an error leaving it can close it */
+typedef struct Fl_Source {
+    Fl_Reader in;
+    FILE *fp;
+    struct Fl_Source *outer; /* the file that is running this one */
+} Fl_Source;
+
+/* what a string object points to, off the heap */
+typedef struct {
+    size_t len;
+    char data[]; /* NUL-terminated as well */
+} Fl_String;
+
+/* what a vector object points to, off the heap as well */
+typedef struct {
+    size_t len, cap;
+    Fl_Object *items[];
+} Fl_Vector;
 
 typedef struct {
     Fl_Error_fn error;
     Fl_CFunc mark, gc;
 } Fl_Handlers;
 
+/* open addressing symbol table, see symtab.c */
+typedef struct {
+    Fl_Object **syms;
+    unsigned *hashes;
+    int cap, count, used; /* used = count + deleted slots */
+    uint64_t version; /* bumped when a global that was callable is bound again, see Fl_Cache */
+} Fl_Symtab;
+
+/* IMPORTANT: this enum and `types` array (in flamingo.c) element order must match */
+typedef enum {
+    T_PAIR, T_FREE, T_NIL, T_NUMBER, T_SYMBOL,
+    T_STRING, T_FUNC, T_MACRO, T_BUILTIN, T_CFUNC, T_PTR, T_CODE, T_FRAME, T_VECTOR,
+    T_MAP
+} Fl_Type;
+
+#define FL_NTYPES (T_MAP + 1)
+
+/* cells come from segments added as the heap grows, see gc.c */
+typedef struct {
+    Fl_Segment *segments; /* newest first */
+    Fl_Segment *current; /* segment being allocated from */
+    Fl_Segment *cursor; /* next segment to try allocating from */
+    Fl_Segment *young; /* segments allocated from since the last collection */
+    Fl_Segment *unswept; /* segments the last collection marked but didn't sweep yet */
+    Fl_Object *bump, *end; /* cells of the current segment never handed out yet */
+    size_t nsegments;
+    size_t target; /* segments to grow to before collecting everything again */
+    size_t limit; /* most segments we may ever have */
+    size_t nursery; /* cells made available to allocation since the last collection */
+    size_t old; /* cells that survived a collection */
+    size_t marked; /* cells marked by the collection in progress */
+    size_t full_at; /* old cells that call for a full collection */
+    Fl_Object **remembered; /* old objects that may point to young ones */
+    size_t nremembered, capremembered;
+    Fl_Object **marks; /* marked objects whose fields are still to be marked */
+    size_t nmarks, capmarks;
+    size_t sweep_budget; /* cells an allocation sweeps before growing the heap instead, 0 for no limit */
+    bool generational; /* false to always collect everything */
+    bool full; /* the collection in progress looks at old objects too */
+    bool marking; /* a full collection is being marked a step at a time */
+    unsigned step_us; /* most microseconds a marking step takes, 0 to mark all at once */
+    bool sweep_full; /* the unswept segments come from a full collection */
+    unsigned long collections[2]; /* minor, full */
+    double pause_total, pause_max; /* seconds */
+    unsigned long pauses[GC_PAUSE_BUCKETS]; /* pauses by microseconds, bucket i from 2^i up to 2^(i+1) */
+    double sweep_total, sweep_max; /* seconds, sweeping done by allocations */
+    size_t allocated; /* cells handed out */
+    size_t freed[FL_NTYPES]; /* cells swept up, by the type they had */
+    size_t in_use_max; /* most cells handed out and not swept up yet at once */
+} Fl_Heap;
+
+/* what the heap of a context went through so far, see Fl_Gc_stats */
+typedef struct {
+    unsigned long collections[2]; /* minor, full */
+    double pause_total, pause_max; /* seconds */
+    size_t allocated[FL_NTYPES], freed[FL_NTYPES]; /* cells, by type */
+    size_t in_use, in_use_max; /* cells handed out and not swept up yet, garbage included */
+    size_t survived; /* cells that survived a collection */
+    size_t cells; /* cells the heap has room for now */
+    size_t limit; /* cells it may ever have room for, 0 for no limit */
+    int gcstack_max; /* deepest the gcstack went */
+} Fl_Gc_Stats;
+
 typedef union {
     Fl_Object *o;
     Fl_CFunc f;
@@ -59,51 +171,81 @@ struct Fl_Object {
 
 struct Fl_Context {
     Fl_Handlers handlers;
-    Fl_Object *gcstack[GC_MAX_STACK_SIZE];
-    int gcstack_index;
-    Fl_Object *objects;
-    int nobject; /* count */
-    Fl_Object *call_list;
+    Fl_Object **gcstack; /* objects C code holds on to */
+    int gcstack_index, gcstack_cap;
+    int gcstack_max; /* the most gcstack_index was before going down, see Fl_Gc_stats */
+    Fl_Heap heap;
+    Fl_Vm *vm;
+    Fl_Pool *pool; /* workers for `pmap`, started the first time it needs them */
+    Fl_Profile *prof; /* samples taken so far while profiling, NULL otherwise */
     Fl_Object *free_list;
-    Fl_Object *sym_list;
+    Fl_Symtab symtab;
     Fl_Object *t; /* everything that is not nil */
     int next_char;
+    int nesting; /* lists the reader is inside of */
+    char *scratch; /* where the reader puts string literals together */
+    size_t scratch_cap;
+    FILE *dump; /* where Fl_optimize lists the code it made, NULL for nowhere */
+    Fl_Source *sources; /* files being run, innermost first */
+    char out[OUT_BUF_SIZE]; /* see Fl_writefp */
+    size_t out_len;
+    jmp_buf *recover; /* where Fl_error goes back to, see Fl_protect */
+    char error[MAX_BUF_LEN * 2]; /* message of the error Fl_protect recovered from */
 };
 
-/* IMPORTANT: this enum and `types` array (in flamingo.c) element order must match */
-typedef enum {
-    T_PAIR, T_FREE, T_NIL, T_NUMBER, T_SYMBOL,
-    T_STRING, T_FUNC, T_MACRO, T_BUILTIN, T_CFUNC, T_PTR
-} Fl_Type;
+/* nil symbol, acts as false, and as an empty list ("()"); one constant shared by every context in
+   the process, so it sits in read-only memory and a stray write to it faults instead of racing */
+extern const Fl_Object Fl_nil;
+#define nil (*(Fl_Object *)&Fl_nil)
 
-/* nil symbol, acts as false, and as an empty list ("()") */
-extern Fl_Object nil;
+/* the number held by immediate `obj`, undoes the rotation done by Fl_T_number */
+static inline Fl_Number Fl_imm_number(const Fl_Object *obj) {
+    union { Fl_Number n; uint64_t v; } t;
+    uint64_t v = (uintptr_t)obj;
+    if (v == FL_IMM_ZERO)
+        return 0.0;
+    /* the top exponent bits were 011 or 100, the one kept tells which */
+    v = (2 - (v >> 63)) | (v & ~(uint64_t)3);
+    t.v = v >> 3 | v << 61;
+    return t.n;
+}
 
 bool Fl_str_equal(Fl_Object *obj, const char *str);
-Fl_Object *Fl_str_make(Fl_Context *ctx, Fl_Object *tail, int c);
+Fl_Object *Fl_str_make(Fl_Context *ctx, const char *str, size_t len);
 
 Fl_Object *Fl_object(Fl_Context *ctx);
 
-Fl_Context *Fl_open(void *ptr, int size);
+Fl_Context *Fl_open(size_t heap_size);
 void Fl_close(Fl_Context *ctx);
 void Fl_run_file(Fl_Context *ctx, FILE *fp);
 Fl_Handlers *Fl_handlers(Fl_Context *ctx);
 void Fl_error(Fl_Context *ctx, const char *message);
+bool Fl_protect(Fl_Context *ctx, Fl_Protected_fn fn, void *data);
 Fl_Object *Fl_next_arg(Fl_Context *ctx, Fl_Object **arg);
 Fl_Type Fl_type(Fl_Context *ctx, Fl_Object *obj);
+const char *Fl_type_name(Fl_Type type);
+Fl_Object *Fl_check_type(Fl_Context *ctx, Fl_Object *obj, Fl_Type type);
 bool Fl_isnil(Fl_Context *ctx, Fl_Object *obj);
+bool Fl_equal(Fl_Context *ctx, Fl_Object *x, Fl_Object *y);
+
+/* Handle scopes, objects made after opening one stay alive until it's closed */
+int Fl_scope_open(Fl_Context *ctx);
+Fl_Object *Fl_scope_close(Fl_Context *ctx, int scope, Fl_Object *result);
 
 /* Mark and sweep garbage collecting */
 void Fl_Gc_push(Fl_Context *ctx, Fl_Object *obj);
 void Fl_Gc_restore(Fl_Context *ctx, int idx);
 int Fl_Gc_save(Fl_Context *ctx);
 void Fl_Gc_mark(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Gc_barrier(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Gc_stats(Fl_Context *ctx, Fl_Gc_Stats *stats);
 
 Fl_Object *Fl_list(Fl_Context *ctx, Fl_Object **objects, int n);
 Fl_Object *Fl_first(Fl_Context *ctx, Fl_Object *obj);
 Fl_Object *Fl_rest(Fl_Context *ctx, Fl_Object *obj);
 
 void Fl_write(Fl_Context *ctx, Fl_Object *obj, Fl_Write_fn fn, void *data, bool with_quotes);
+void Fl_write_spans(Fl_Context *ctx, Fl_Object *obj, Fl_Span_fn fn, void *data, bool with_quotes);
 void Fl_writefp(Fl_Context *ctx, Fl_Object *obj, FILE *fp);
 
 int Fl_to_string(Fl_Context *ctx, Fl_Object *obj, char *buf, int size);
@@ -113,6 +255,15 @@ void *Fl_to_ptr(Fl_Context *ctx, Fl_Object *obj);
 void Fl_set(Fl_Context *ctx, Fl_Object *sym, Fl_Object *v);
 Fl_Object *Fl_read(Fl_Context *ctx, Fl_Read_fn fn, void *data);
 Fl_Object *Fl_readfp(Fl_Context *ctx, FILE *fp);
+void Fl_reader_buf(Fl_Reader *r, const char *buf, size_t len);
+void Fl_reader_fn(Fl_Reader *r, Fl_Read_fn fn, void *data);
+void Fl_reader_file(Fl_Reader *r, FILE *fp);
+void Fl_reader_close(Fl_Reader *r);
+Fl_Object *Fl_read_from(Fl_Context *ctx, Fl_Reader *r);
 Fl_Object *Fl_eval(Fl_Context *ctx, Fl_Object *obj);
+Fl_Object *Fl_compile(Fl_Context *ctx, Fl_Object *obj);
+Fl_Object *Fl_optimize(Fl_Context *ctx, Fl_Object *obj);
+Fl_Object *Fl_exec(Fl_Context *ctx, Fl_Object *code);
+Fl_Object *Fl_call(Fl_Context *ctx, Fl_Object *fn, Fl_Object **argv, int argc);
 
 #endif /* FLAMINGO_H */
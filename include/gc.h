@@ -1,12 +1,71 @@
 #ifndef FLAMINGO_GC_H
 #define FLAMINGO_GC_H
 
+#include <stdint.h>
+
 #include "flamingo.h"
 
+#define GC_SEGMENT_SIZE  (1 << 16) /* bytes, segments are aligned to their size */
+#define GC_SEGMENT_SLOTS (GC_SEGMENT_SIZE / (int)sizeof(Fl_Object)) /* header included */
+#define GC_NURSERY_CELLS (1 << 15) /* allocated between minor collections */
+#define GC_MIN_FREE      (GC_SEGMENT_SLOTS / 8) /* free cells that make a segment worth using */
+#define GC_GROWTH        2 /* old space over live data after a full collection */
+#define GC_SWEEP_BUDGET  (4 * GC_SEGMENT_SLOTS) /* default for the cells one allocation may sweep */
+#define GC_STEP_US       1000 /* default for the microseconds an incremental marking step may take */
+
+typedef uint64_t Fl_Bitmap[GC_SEGMENT_SLOTS / 64];
+
+struct Fl_Segment {
+    Fl_Segment *next;
+    Fl_Segment *next_young;
+    Fl_Segment *next_unswept;
+    Fl_Object *free; /* free list, filled by sweeping */
+    Fl_Object *top; /* cells from here on were never handed out */
+    int nfree;
+    bool young; /* on the heap's young list */
+    bool unswept; /* on the heap's unswept list, its free list is stale */
+    Fl_Bitmap mark; /* reached by the collection in progress */
+    Fl_Bitmap old; /* survived a collection */
+    Fl_Bitmap remembered; /* in the remembered set */
+};
+
+#define GC_HEADER_SLOTS ((int)((sizeof(Fl_Segment) + sizeof(Fl_Object) - 1) / sizeof(Fl_Object)))
+
+#define M_segment(X)     ((Fl_Segment *)((uintptr_t)(X) & ~(uintptr_t)(GC_SEGMENT_SIZE - 1)))
+#define M_slot(X)        ((int)(((uintptr_t)(X) & (GC_SEGMENT_SIZE - 1)) / sizeof(Fl_Object)))
+#define M_cells(S)       ((Fl_Object *)(S) + GC_HEADER_SLOTS)
+#define M_cells_end(S)   ((Fl_Object *)(S) + GC_SEGMENT_SLOTS)
+#define M_bit(B, I)      ((B)[(I) >> 6] >> ((I) & 63) & 1)
+#define M_bitset(B, I)   ((B)[(I) >> 6] |= (uint64_t)1 << ((I) & 63))
+#define M_bitclear(B, I) ((B)[(I) >> 6] &= ~((uint64_t)1 << ((I) & 63)))
+#define M_isold(X)       M_bit(M_segment(X)->old, M_slot(X))
+
+/* write barrier, after storing a reference into heap object `X` */
+#define M_barrier(CTX, X)                                                          \
+    do {                                                                           \
+        Fl_Segment *seg_ = M_segment(X);                                           \
+        if ((M_bit(seg_->old, M_slot(X)) && !M_bit(seg_->remembered, M_slot(X)))   \
+            || (CTX)->heap.marking)                                                \
+            Fl_Gc_store(CTX, X);                                                   \
+    } while (0)
+
+/* push `X` on the gcstack, only calling out when it has to grow */
+#define M_gcpush(CTX, X)                                         \
+    ((CTX)->gcstack_index < (CTX)->gcstack_cap                  \
+        ? (void)((CTX)->gcstack[(CTX)->gcstack_index++] = (X)) \
+        : Fl_Gc_push(CTX, X))
+
 void Fl_Gc_push(Fl_Context *ctx, Fl_Object *obj);
 void Fl_Gc_restore(Fl_Context *ctx, int index);
 int Fl_Gc_save(Fl_Context *ctx);
 void Fl_Gc_mark(Fl_Context *ctx, Fl_Object *obj);
+bool Fl_Gc_marked(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Gc_store(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Gc_barrier(Fl_Context *ctx, Fl_Object *obj);
 void Fl_Gc_collect(Fl_Context *ctx);
+void Fl_Gc_stats(Fl_Context *ctx, Fl_Gc_Stats *stats);
+void Fl_Gc_init(Fl_Context *ctx, size_t size);
+void Fl_Gc_free(Fl_Context *ctx);
+Fl_Object *Fl_Gc_alloc(Fl_Context *ctx);
 
 #endif /* FLAMINGO_GC_H */
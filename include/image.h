@@ -0,0 +1,11 @@
+#ifndef FLAMINGO_IMAGE_H
+#define FLAMINGO_IMAGE_H
+
+#include "flamingo.h"
+
+void Fl_image_save(Fl_Context *ctx, const char *path);
+bool Fl_image_load(Fl_Context *ctx, const char *path);
+void *Fl_image_pack(Fl_Context *ctx, Fl_Object *obj, bool bindings, size_t *size);
+Fl_Object *Fl_image_unpack(Fl_Context *ctx, const void *pack, size_t size, bool bindings);
+
+#endif /* FLAMINGO_IMAGE_H */
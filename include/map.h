@@ -0,0 +1,40 @@
+#ifndef FLAMINGO_MAP_H
+#define FLAMINGO_MAP_H
+
+#include <stddef.h>
+
+#include "flamingo.h"
+
+#define MAP_INIT_SIZE 8
+#define MAP_STEP      16 /* slots of the old table each operation moves over while growing */
+
+#define M_map(X) ((Fl_Map *)M_rest(X))
+
+typedef struct {
+    Fl_Object *key; /* NULL for a slot never used */
+    Fl_Object *value;
+    unsigned hash;
+} Fl_Entry;
+
+typedef struct {
+    Fl_Entry *slots;
+    size_t cap, count, used; /* used = count + deleted slots */
+} Fl_Table;
+
+/* what a map object points to: open addressing, the old table is moved into the new one a bit at a
+   time after a resize rather than all at once */
+typedef struct {
+    Fl_Table cur, old;
+    size_t moved; /* slots of `old` already moved, it is in use while its slots aren't NULL */
+} Fl_Map;
+
+Fl_Object *Fl_Map_make(Fl_Context *ctx);
+Fl_Object *Fl_Map_get(Fl_Context *ctx, Fl_Object *map, Fl_Object *key);
+void Fl_Map_set(Fl_Context *ctx, Fl_Object *map, Fl_Object *key, Fl_Object *value);
+bool Fl_Map_del(Fl_Context *ctx, Fl_Object *map, Fl_Object *key);
+bool Fl_Map_next(Fl_Object *map, size_t *i, Fl_Object **key, Fl_Object **value);
+size_t Fl_Map_len(Fl_Object *map);
+void Fl_Map_mark(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Map_free(Fl_Object *obj);
+
+#endif /* FLAMINGO_MAP_H */
@@ -0,0 +1,38 @@
+#ifndef FLAMINGO_POOL_H
+#define FLAMINGO_POOL_H
+
+#include <pthread.h>
+
+#include "flamingo.h"
+
+#define POOL_MAX_WORKERS 64
+
+/* a context of its own on a thread of its own, waiting for a part of a list to work on */
+typedef struct {
+    Fl_Pool *pool;
+    Fl_Context *ctx;
+    pthread_t thread;
+    int index;
+    unsigned round; /* the last one it has seen */
+    void *in, *out; /* packed (function . part) and the results, see Fl_image_pack */
+    size_t in_size, out_size;
+    bool collect; /* keep the results */
+    bool failed;
+    char error[MAX_BUF_LEN * 2];
+} Fl_Worker;
+
+struct Fl_Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    unsigned round; /* bumped to start the workers */
+    int active; /* workers taking part in this round */
+    int pending; /* of them, those still working */
+    bool quit;
+    int n; /* workers started */
+    Fl_Worker workers[POOL_MAX_WORKERS];
+};
+
+Fl_Object *Fl_Pool_map(Fl_Context *ctx, Fl_Object *fn, Fl_Object *list, int threads, bool collect);
+void Fl_Pool_free(Fl_Context *ctx);
+
+#endif /* FLAMINGO_POOL_H */
@@ -0,0 +1,43 @@
+#ifndef FLAMINGO_PROF_H
+#define FLAMINGO_PROF_H
+
+#include "flamingo.h"
+
+#define PROF_INTERVAL_US 1000 /* default CPU time between samples */
+#define PROF_MAX_DEPTH   64 /* innermost calls a sample keeps */
+#define PROF_TOP         20 /* rows of the table Fl_Prof_stop prints */
+
+/* a distinct stack of call sites, by their number, outermost first */
+typedef struct {
+    unsigned *sites;
+    int n;
+    unsigned hash;
+    unsigned long count;
+} Fl_Stack;
+
+/* the call site a form is */
+typedef struct {
+    Fl_Object *form;
+    unsigned site;
+} Fl_Site;
+
+/* the samples of a context, see prof.c */
+struct Fl_Profile {
+    FILE *out; /* where the folded stacks go */
+    char **names; /* call sites as written, by number */
+    size_t nnames, capnames;
+    unsigned *byname; /* open addressing from a name to its number + 1 */
+    size_t capbyname;
+    Fl_Site *byform; /* open addressing, the forms whose names are already made */
+    size_t capbyform, nbyform;
+    unsigned long collections; /* forms may have been freed since byform was filled if this changed */
+    Fl_Stack *stacks; /* open addressing */
+    size_t nstacks, capstacks;
+    unsigned long samples;
+};
+
+void Fl_Prof_start(Fl_Context *ctx, FILE *out, unsigned interval_us);
+void Fl_Prof_stop(Fl_Context *ctx);
+void Fl_Prof_sample(Fl_Context *ctx, int depth);
+
+#endif /* FLAMINGO_PROF_H */
@@ -0,0 +1,14 @@
+#ifndef FLAMINGO_SYMTAB_H
+#define FLAMINGO_SYMTAB_H
+
+#include <stddef.h>
+
+#include "flamingo.h"
+
+void Fl_Symtab_init(Fl_Context *ctx);
+void Fl_Symtab_free(Fl_Context *ctx);
+Fl_Object *Fl_Symtab_intern(Fl_Context *ctx, const char *name, size_t len);
+void Fl_Symtab_mark(Fl_Context *ctx);
+void Fl_Symtab_sweep(Fl_Context *ctx);
+
+#endif /* FLAMINGO_SYMTAB_H */
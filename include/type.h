@@ -10,5 +10,8 @@ Fl_Object *Fl_T_string(Fl_Context *ctx, const char *str);
 Fl_Object *Fl_T_symbol(Fl_Context *ctx, const char *name);
 Fl_Object *Fl_T_cfunc(Fl_Context *ctx, Fl_CFunc fn);
 Fl_Object *Fl_T_ptr(Fl_Context *ctx, void *ptr);
+Fl_Object *Fl_T_vector(Fl_Context *ctx, Fl_Object **items, size_t n);
+
+void Fl_vec_push(Fl_Context *ctx, Fl_Object *vec, Fl_Object *item);
 
 #endif /* FLAMINGO_TYPE_H */
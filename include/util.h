@@ -1,8 +1,12 @@
 #ifndef FLAMINGO_UTIL_H
 #define FLAMINGO_UTIL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 const char *os_name(void);
 const char *get_home(void);
 char *strip(char *str);
+bool parse_size(const char *str, size_t *size);
 
 #endif /* FLAMINGO_UTIL_H */
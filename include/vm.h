@@ -0,0 +1,104 @@
+#ifndef FLAMINGO_VM_H
+#define FLAMINGO_VM_H
+
+#include <signal.h>
+
+#include "flamingo.h"
+
+#define VM_MAX_DEPTH (1 << 20) /* nested calls before we give up */
+#define VM_MAX_FOLD 16 /* arguments of a built-in call that is folded at most */
+
+#define VM_POOL_SIZES 8 /* frames with fewer slots than this are recycled */
+#define VM_POOL_MAX (1 << 16) /* spare frames kept per size */
+
+#define M_code(X) ((Fl_Code *)M_rest(X))
+#define M_frame(X) ((Fl_Frame *)M_rest(X))
+
+/* IMPORTANT: this enum and `builtins` array (in flamingo.c) element order must match */
+enum {
+    BI_LET, BI_SET, BI_IF, BI_FN, BI_MACRO, BI_USE, BI_WHILE, BI_QUOTE, BI_EVAL, BI_TYPE, BI_AND,
+    BI_OR, BI_DO, BI_CONS, BI_FIRST, BI_REST, BI_SETF, BI_SETR, BI_LIST, BI_NOT, BI_ATOM, BI_PRINT,
+    BI_EQ, BI_LT, BI_LE, BI_GT, BI_GE, BI_ADD, BI_SUB, BI_MUL, BI_DIV, BI_VECTOR, BI_VREF, BI_VSET,
+    BI_VLEN, BI_VPUSH, BI_LIST2VEC, BI_VEC2LIST, BI_MAPNEW, BI_MAPGET, BI_MAPSET, BI_MAPDEL, BI_MAPKEYS,
+    BI_MAPLEN, BI_LEN
+};
+
+/* a local name: slot `slot` of the frame `level` blocks deep in the activation */
+typedef struct {
+    Fl_Object *sym;
+    int slot, level;
+    int prev; /* the decl visible before this one, -1 at the outermost */
+} Fl_Decl;
+
+/*
+ * what the global a call site calls was bound to when it last passed the checks on its way to being
+ * called; good for as long as the symbol table version is the one it was seen at, which holds the
+ * callee alive too
+ */
+typedef struct {
+    uint64_t version; /* 0 for never */
+    Fl_Object *callee;
+} Fl_Cache;
+
+/* compiled form of a function, macro or top-level expression (T_CODE) */
+typedef struct {
+    int *ops; /* bytecode, NULL until first run */
+    int nops, capops;
+    Fl_Object **consts;
+    int nconsts, capconsts;
+    Fl_Cache *caches; /* of the call sites with a global callee, not saved with the code */
+    int ncaches, capcaches;
+    int maxstack; /* deepest the value stack gets while running this */
+    bool expr; /* `body` is a single expression rather than a list of forms */
+    bool ready;
+    unsigned compiling; /* vm epoch + 1 while being compiled */
+    Fl_Object *params, *body;
+    int nparams; /* fixed parameters, followed by the rest parameter if `rest` */
+    bool rest;
+    int nslots; /* size of the activation frame: parameters and then `let`s */
+    Fl_Decl *decls;
+    int ndecls, capdecls;
+    /* where the prototype appeared, so locals of enclosing code can be addressed */
+    Fl_Object *parent;
+    int parent_decl, parent_level;
+} Fl_Code;
+
+/* storage of the locals of one activation, or of one iteration of a loop (T_FRAME) */
+typedef struct Fl_Frame {
+    Fl_Object *parent; /* frame the code was closed in, nil at the top; links spare frames */
+    int n;
+    Fl_Object *slots[];
+} Fl_Frame;
+
+typedef struct {
+    Fl_Object *code, *env;
+    int pc; /* where to resume, just after the last call site */
+    int bp; /* base of this activation's value stack */
+} Fl_Activation;
+
+struct Fl_Vm {
+    Fl_Object **stack;
+    int sp, stack_cap;
+    Fl_Activation *frames;
+    int depth, frames_cap;
+    int frozen; /* activations below this one haven't run since the last collection */
+    Fl_Object *trace; /* traceback cells, built on error */
+    int trace_cap;
+    unsigned epoch; /* bumped whenever an error unwinds the vm */
+    volatile sig_atomic_t sample; /* the profiler wants a sample at the next safe point, see prof.c */
+    Fl_Frame *pool[VM_POOL_SIZES]; /* spare frames by size */
+    int npool[VM_POOL_SIZES];
+};
+
+void Fl_Vm_init(Fl_Context *ctx);
+void Fl_Vm_free(Fl_Context *ctx);
+void Fl_Vm_mark(Fl_Context *ctx);
+Fl_Object *Fl_Vm_unwind(Fl_Context *ctx);
+
+Fl_Object *Fl_Code_make(Fl_Context *ctx, Fl_Object *params, Fl_Object *body);
+void Fl_Code_mark(Fl_Context *ctx, Fl_Object *obj);
+void Fl_Code_free(Fl_Object *obj);
+
+void Fl_Frame_free(Fl_Context *ctx, Fl_Object *obj);
+
+#endif /* FLAMINGO_VM_H */
@@ -5,8 +5,10 @@
 #include <errno.h>
 #include <float.h>
 #include <ctype.h>
+#include <string.h>
 
 #include "type.h"
+#include "pool.h"
 #include "util.h"
 #include "lib.h"
 
@@ -60,8 +62,305 @@ static Fl_Object *bs_str_to_num(Fl_Context *ctx, Fl_Object *args) {
     return str2num(&n, strip(buf)) == S2N_SUCCESS ? Fl_T_number(ctx, n) : Fl_T_bool(ctx, false);
 }
 
+/*
+ * List library, done here rather than in base.fl so that it runs in loops instead of recursing
+ */
+
+/* cut the gcstack back to `gc`, keeping only `obj` */
+static void bs_keep(Fl_Context *ctx, int gc, Fl_Object *obj) {
+    Fl_Gc_restore(ctx, gc);
+    Fl_Gc_push(ctx, obj);
+}
+
+/* add `obj` to the end of the list from `*head` to `*last` */
+static void bs_append(Fl_Context *ctx, Fl_Object **head, Fl_Object **last, Fl_Object *obj) {
+    Fl_Object *pair = Fl_T_cons(ctx, obj, &nil);
+    if (M_isnil(*head)) {
+        *head = pair;
+    } else {
+        M_rest(*last) = pair;
+        Fl_Gc_barrier(ctx, *last);
+    }
+    *last = pair;
+}
+
+/* first element of list `l`, which mustn't be empty */
+static Fl_Object *bs_item(Fl_Context *ctx, Fl_Object *l) {
+    return M_first(Fl_check_type(ctx, l, T_PAIR));
+}
+
+/* join lists `l1` and `l2` together into a single new list, `l2` isn't copied */
+static Fl_Object *bs_join(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *l1 = Fl_next_arg(ctx, &args), *l2 = Fl_next_arg(ctx, &args);
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(l1); l1 = M_rest(l1)) {
+        bs_append(ctx, &head, &last, bs_item(ctx, l1));
+        bs_keep(ctx, gc, head);
+    }
+    if (M_isnil(head))
+        return l2;
+    M_rest(last) = l2;
+    Fl_Gc_barrier(ctx, last);
+    return head;
+}
+
+/* destructively join list `l2` to the end of list `l1` */
+static Fl_Object *bs_append_bang(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *l1 = Fl_next_arg(ctx, &args), *l2 = Fl_next_arg(ctx, &args);
+    if (M_isnil(l1))
+        return l2;
+    Fl_Object *last = Fl_check_type(ctx, l1, T_PAIR);
+    while (!M_isnil(M_rest(last)))
+        last = Fl_check_type(ctx, M_rest(last), T_PAIR);
+    M_rest(last) = l2;
+    Fl_Gc_barrier(ctx, last);
+    return l1;
+}
+
+/* number of elements of list `l` */
+static Fl_Object *bs_len(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *l = Fl_next_arg(ctx, &args);
+    size_t n = 0;
+    for (; !M_isnil(l); l = M_rest(Fl_check_type(ctx, l, T_PAIR)))
+        ++n;
+    return Fl_T_number(ctx, n);
+}
+
+/* list `l` in reverse order */
+static Fl_Object *bs_rev(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *l = Fl_next_arg(ctx, &args), *res = &nil;
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(l); l = M_rest(l)) {
+        res = Fl_T_cons(ctx, bs_item(ctx, l), res);
+        bs_keep(ctx, gc, res);
+    }
+    return res;
+}
+
+/* element `i` of list `l`, nil past its end */
+static Fl_Object *bs_at(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Number i = Fl_to_number(ctx, Fl_next_arg(ctx, &args));
+    Fl_Object *l = Fl_next_arg(ctx, &args);
+    for (; i >= 1 && !M_isnil(l); --i)
+        l = Fl_rest(ctx, l);
+    return Fl_first(ctx, l);
+}
+
+/* element `i` of list or vector `seq`, nil past its end */
+static Fl_Object *bs_nth(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *seq = Fl_next_arg(ctx, &args);
+    Fl_Number i = Fl_to_number(ctx, Fl_next_arg(ctx, &args));
+    if (M_type(seq) == T_VECTOR)
+        return i >= 0 && i < M_vector(seq)->len ? M_vector(seq)->items[(size_t)i] : &nil;
+    for (; i >= 1 && !M_isnil(seq); --i)
+        seq = Fl_rest(ctx, seq);
+    return Fl_first(ctx, seq);
+}
+
+/* list of the results of function `func` on each element of list `l` */
+static Fl_Object *bs_map(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *l = Fl_next_arg(ctx, &args);
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(l); l = M_rest(l)) {
+        Fl_Object *item = bs_item(ctx, l);
+        /* `func` may cut the list, hold on to the rest of it */
+        Fl_Gc_push(ctx, l);
+        bs_append(ctx, &head, &last, Fl_call(ctx, func, &item, 1));
+        bs_keep(ctx, gc, head);
+    }
+    return head;
+}
+
+/* list of the elements of list `l` that function `func` doesn't return nil for */
+static Fl_Object *bs_filter(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *l = Fl_next_arg(ctx, &args);
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(l); l = M_rest(l)) {
+        Fl_Object *item = bs_item(ctx, l);
+        Fl_Gc_push(ctx, l);
+        if (!M_isnil(Fl_call(ctx, func, &item, 1)))
+            bs_append(ctx, &head, &last, item);
+        bs_keep(ctx, gc, head);
+    }
+    return head;
+}
+
+/* `acc` = (func acc e) for each element `e` of list `l`, in order */
+static Fl_Object *bs_foldl(Fl_Context *ctx, Fl_Object *func, Fl_Object *acc, Fl_Object *l) {
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(l); l = M_rest(l)) {
+        Fl_Object *argv[] = { acc, bs_item(ctx, l) };
+        Fl_Gc_push(ctx, l);
+        acc = Fl_call(ctx, func, argv, 2);
+        bs_keep(ctx, gc, acc);
+    }
+    return acc;
+}
+
+/* combine the elements of list `l` with function `func`, starting from `init` */
+static Fl_Object *bs_fold(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *init = Fl_next_arg(ctx, &args);
+    return bs_foldl(ctx, func, init, Fl_next_arg(ctx, &args));
+}
+
+/* combine the elements of list `l` with function `func`, starting from the first one */
+static Fl_Object *bs_reduce(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *l = Fl_next_arg(ctx, &args);
+    if (M_isnil(l))
+        return &nil;
+    return bs_foldl(ctx, func, bs_item(ctx, l), M_rest(l));
+}
+
+/* numbers from `start` (default 0) up to, but without, `end`, `step` (default 1) apart */
+static Fl_Object *bs_range(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Number start = 0, end = Fl_to_number(ctx, Fl_next_arg(ctx, &args)), step = 1;
+    if (!M_isnil(args)) {
+        start = end;
+        end = Fl_to_number(ctx, Fl_next_arg(ctx, &args));
+    }
+    if (!M_isnil(args))
+        step = Fl_to_number(ctx, Fl_next_arg(ctx, &args));
+    if (step == 0)
+        Fl_error(ctx, "range step can't be zero");
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    for (Fl_Number n = start; step > 0 ? n < end : n > end; n += step) {
+        bs_append(ctx, &head, &last, Fl_T_number(ctx, n));
+        bs_keep(ctx, gc, head);
+    }
+    return head;
+}
+
+/* whether `a` goes before `b`, by function `less` if there is one */
+static bool bs_less(Fl_Context *ctx, Fl_Object *less, Fl_Object *a, Fl_Object *b) {
+    if (less) {
+        Fl_Object *argv[] = { a, b };
+        return !M_isnil(Fl_call(ctx, less, argv, 2));
+    }
+    if (M_type(a) == T_NUMBER && M_type(b) == T_NUMBER)
+        return M_number(a) < M_number(b);
+    if (M_type(a) == T_STRING && M_type(b) == T_STRING) {
+        Fl_String *x = M_string(a), *y = M_string(b);
+        int cmp = memcmp(x->data, y->data, x->len < y->len ? x->len : y->len);
+        return cmp < 0 || (cmp == 0 && x->len < y->len);
+    }
+    Fl_error(ctx, "sort only knows how to compare numbers or strings, give it a function");
+    return false;
+}
+
+/* list `l` sorted by function `less`, or by `<`; a stable merge sort */
+static Fl_Object *bs_sort(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *l = Fl_next_arg(ctx, &args);
+    Fl_Object *less = M_isnil(args) ? NULL : Fl_next_arg(ctx, &args);
+    /* both halves of each merge live in vectors, so `less` can't collect them */
+    Fl_Object *src = Fl_T_vector(ctx, NULL, 0), *dst, *tmp;
+    for (; !M_isnil(l); l = M_rest(l))
+        Fl_vec_push(ctx, src, bs_item(ctx, l));
+    size_t n = M_vector(src)->len;
+    dst = Fl_T_vector(ctx, M_vector(src)->items, n);
+    int gc = Fl_Gc_save(ctx);
+    /* runs of `w` elements are merged pairwise from `src` into `dst`, which then trade places */
+    for (size_t w = 1; w < n; w *= 2, tmp = src, src = dst, dst = tmp) {
+        Fl_Object **s = M_vector(src)->items, **d = M_vector(dst)->items;
+        for (size_t lo = 0; lo < n; lo += 2 * w) {
+            size_t mid = lo + w < n ? lo + w : n, hi = lo + 2 * w < n ? lo + 2 * w : n;
+            for (size_t i = lo, j = mid, k = lo; k < hi; ++k) {
+                d[k] = i < mid && (j == hi || !bs_less(ctx, less, s[j], s[i])) ? s[i++] : s[j++];
+                Fl_Gc_restore(ctx, gc);
+            }
+        }
+        Fl_Gc_barrier(ctx, dst);
+    }
+    Fl_Object *res = &nil;
+    for (Fl_Object **items = M_vector(src)->items; n--;) {
+        res = Fl_T_cons(ctx, items[n], res);
+        bs_keep(ctx, gc, res);
+    }
+    return res;
+}
+
+/* `threads` argument of pmap and pfor-each, 0 for as many as there are processors */
+static int bs_threads(Fl_Context *ctx, Fl_Object *args) {
+    if (M_isnil(args))
+        return 0;
+    Fl_Number n = Fl_to_number(ctx, Fl_next_arg(ctx, &args));
+    if (n < 0 || n != (int)n)
+        Fl_error(ctx, "thread count must be a whole number");
+    return (int)n;
+}
+
+/* like `map`, with list `l` split between `threads` contexts running in parallel, see Fl_Pool_map */
+static Fl_Object *bs_pmap(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *l = Fl_next_arg(ctx, &args);
+    return Fl_Pool_map(ctx, func, l, bs_threads(ctx, args), true);
+}
+
+/* `func` on each element of list `l` for its effects, in parallel like pmap */
+static Fl_Object *bs_pfor_each(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Object *func = Fl_next_arg(ctx, &args), *l = Fl_next_arg(ctx, &args);
+    return Fl_Pool_map(ctx, func, l, bs_threads(ctx, args), false);
+}
+
+/* add `(name value)` to the list from `*head` to `*last` */
+static void bs_stat(Fl_Context *ctx, Fl_Object **head, Fl_Object **last, const char *name, Fl_Object *value) {
+    Fl_Object *entry[2] = { Fl_T_symbol(ctx, name), value };
+    bs_append(ctx, head, last, Fl_list(ctx, entry, 2));
+}
+
+/* add `(name (type count) ...)` for the types with cells in `counts` */
+static void bs_stat_types(Fl_Context *ctx, Fl_Object **head, Fl_Object **last, const char *name,
+                          const size_t *counts) {
+    Fl_Object *types = &nil, *end = NULL;
+    for (int t = 0; t < FL_NTYPES; ++t) {
+        if (counts[t])
+            bs_stat(ctx, &types, &end, Fl_type_name(t), Fl_T_number(ctx, counts[t]));
+    }
+    bs_append(ctx, head, last, Fl_T_cons(ctx, Fl_T_symbol(ctx, name), types));
+}
+
+/* the heap's counters, as a list of `(name value)`, see Fl_Gc_Stats */
+static Fl_Object *bs_gc_stats(Fl_Context *ctx, Fl_Object *args) {
+    Fl_Gc_Stats st;
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    M_unused(args);
+    Fl_Gc_stats(ctx, &st);
+    bs_stat(ctx, &head, &last, "minor-collections", Fl_T_number(ctx, st.collections[0]));
+    bs_stat(ctx, &head, &last, "full-collections", Fl_T_number(ctx, st.collections[1]));
+    bs_stat(ctx, &head, &last, "pause-total", Fl_T_number(ctx, st.pause_total));
+    bs_stat(ctx, &head, &last, "pause-max", Fl_T_number(ctx, st.pause_max));
+    bs_stat(ctx, &head, &last, "in-use", Fl_T_number(ctx, st.in_use));
+    bs_stat(ctx, &head, &last, "in-use-max", Fl_T_number(ctx, st.in_use_max));
+    bs_stat(ctx, &head, &last, "survived", Fl_T_number(ctx, st.survived));
+    bs_stat(ctx, &head, &last, "cells", Fl_T_number(ctx, st.cells));
+    bs_stat(ctx, &head, &last, "limit", st.limit ? Fl_T_number(ctx, st.limit) : &nil);
+    bs_stat(ctx, &head, &last, "gcstack-max", Fl_T_number(ctx, st.gcstack_max));
+    bs_stat_types(ctx, &head, &last, "allocated", st.allocated);
+    bs_stat_types(ctx, &head, &last, "freed", st.freed);
+    bs_keep(ctx, gc, head);
+    return head;
+}
+
 void bs_register_all(Fl_Context *ctx) {
     Fl_set(ctx, Fl_T_symbol(ctx, "platform"), Fl_T_cfunc(ctx, bs_platform));
     Fl_set(ctx, Fl_T_symbol(ctx, "read"), Fl_T_cfunc(ctx, bs_read));
     Fl_set(ctx, Fl_T_symbol(ctx, "num"), Fl_T_cfunc(ctx, bs_str_to_num));
+    Fl_set(ctx, Fl_T_symbol(ctx, "join"), Fl_T_cfunc(ctx, bs_join));
+    Fl_set(ctx, Fl_T_symbol(ctx, "append!"), Fl_T_cfunc(ctx, bs_append_bang));
+    Fl_set(ctx, Fl_T_symbol(ctx, "len"), Fl_T_cfunc(ctx, bs_len));
+    Fl_set(ctx, Fl_T_symbol(ctx, "rev"), Fl_T_cfunc(ctx, bs_rev));
+    Fl_set(ctx, Fl_T_symbol(ctx, "at"), Fl_T_cfunc(ctx, bs_at));
+    Fl_set(ctx, Fl_T_symbol(ctx, "nth"), Fl_T_cfunc(ctx, bs_nth));
+    Fl_set(ctx, Fl_T_symbol(ctx, "map"), Fl_T_cfunc(ctx, bs_map));
+    Fl_set(ctx, Fl_T_symbol(ctx, "filter"), Fl_T_cfunc(ctx, bs_filter));
+    Fl_set(ctx, Fl_T_symbol(ctx, "fold"), Fl_T_cfunc(ctx, bs_fold));
+    Fl_set(ctx, Fl_T_symbol(ctx, "reduce"), Fl_T_cfunc(ctx, bs_reduce));
+    Fl_set(ctx, Fl_T_symbol(ctx, "range"), Fl_T_cfunc(ctx, bs_range));
+    Fl_set(ctx, Fl_T_symbol(ctx, "sort"), Fl_T_cfunc(ctx, bs_sort));
+    Fl_set(ctx, Fl_T_symbol(ctx, "pmap"), Fl_T_cfunc(ctx, bs_pmap));
+    Fl_set(ctx, Fl_T_symbol(ctx, "pfor-each"), Fl_T_cfunc(ctx, bs_pfor_each));
+    Fl_set(ctx, Fl_T_symbol(ctx, "gc-stats"), Fl_T_cfunc(ctx, bs_gc_stats));
 }
@@ -1,41 +1,60 @@
 #include <string.h>
+#include <math.h>
 
 #include "flamingo.h"
 #include "type.h"
 #include "gc.h"
+#include "symtab.h"
+#include "map.h"
+#include "vm.h"
+#include "pool.h"
+#include "prof.h"
 
-/* IMPORTANT: this enum and `builtins` array element order must match */
-enum {
-    BI_LET, BI_SET, BI_IF, BI_FN, BI_MACRO, BI_USE, BI_WHILE, BI_QUOTE, BI_EVAL, BI_TYPE, BI_AND,
-    BI_OR, BI_DO, BI_CONS, BI_FIRST, BI_REST, BI_SETF, BI_SETR, BI_LIST, BI_NOT, BI_ATOM, BI_PRINT,
-    BI_EQ, BI_LT, BI_LE, BI_GT, BI_GE, BI_ADD, BI_SUB, BI_MUL, BI_DIV, BI_LEN
-};
-
+/* IMPORTANT: this array and the BI_ enum (in vm.h) element order must match */
 static const char *const builtins[BI_LEN] = {
     "let", "set", "if", "fn", "macro", "use", "while", "quote", "eval", "type", "and",
     "or", "do", "cons", "first", "rest", "setf", "setr", "list", "not", "atom", "print",
-    "=", "<", "<=", ">", ">=", "+", "-", "*", "/"
+    "=", "<", "<=", ">", ">=", "+", "-", "*", "/", "vector", "vec-ref", "vec-set!", "vec-len",
+    "vec-push", "list->vec", "vec->list", "map-new", "map-get", "map-set", "map-del", "map-keys",
+    "map-len"
 };
 
 static const char *const types[] = {
     "pair", "free", "nil", "number",
     "symbol", "string", "function", "macro",
-    "built-in", "c-function", "pointer"
+    "built-in", "c-function", "pointer", "code",
+    "frame", "vector", "map"
 };
 
-Fl_Object nil = { { (void *)(T_NIL << 2 | 1) }, { NULL } };
+const Fl_Object Fl_nil = { { (void *)(T_NIL << 2 | 1) }, { NULL } };
 
 Fl_Handlers *Fl_handlers(Fl_Context *ctx) {
     return &ctx->handlers;
 }
 
+/* close the files being run inside `until` */
+static void p_close_sources(Fl_Context *ctx, Fl_Source *until) {
+    while (ctx->sources != until) {
+        Fl_Source *src = ctx->sources;
+        ctx->sources = src->outer;
+        Fl_reader_close(&src->in);
+        fclose(src->fp);
+        free(src);
+    }
+}
+
 void Fl_error(Fl_Context *ctx, const char *message) {
-    Fl_Object *cl = ctx->call_list;
-    /* reset context state */
-    ctx->call_list = &nil;
+    /* reset context state, keeping the interrupted calls for the traceback */
+    Fl_Object *cl = Fl_Vm_unwind(ctx);
+    ctx->nesting = 0;
     /* call custom error handler if there is one */
     if (ctx->handlers.error)
         ctx->handlers.error(ctx, message, cl);
+    /* inside Fl_protect - hand the message over and go back there */
+    if (ctx->recover) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s", message);
+        longjmp(*ctx->recover, 1);
+    }
     /* error handler returned - print error, traceback and exit unsuccessfully */
     fprintf(stderr, "[error] %s\n", message);
     while (!M_isnil(cl)) {
@@ -47,6 +66,31 @@ void Fl_error(Fl_Context *ctx, const char *message) {
     exit(EXIT_FAILURE);
 }
 
+/* run `fn`, returning false with the message in ctx->error if it raised an error rather than exiting;
+   protected calls nest, and may be made by C functions the vm is running */
+bool Fl_protect(Fl_Context *ctx, Fl_Protected_fn fn, void *data) {
+    jmp_buf here, *outer = ctx->recover;
+    int idx = Fl_Gc_save(ctx), nesting = ctx->nesting;
+    int sp = ctx->vm ? ctx->vm->sp : 0, depth = ctx->vm ? ctx->vm->depth : 0;
+    Fl_Source *sources = ctx->sources;
+    ctx->recover = &here;
+    if (setjmp(here)) {
+        /* the unwind emptied the vm, give back the calls that were running when we got here */
+        ctx->recover = outer;
+        Fl_Gc_restore(ctx, idx);
+        ctx->nesting = nesting;
+        p_close_sources(ctx, sources);
+        if (ctx->vm) {
+            ctx->vm->sp = sp;
+            ctx->vm->depth = depth;
+        }
+        return false;
+    }
+    fn(ctx, data);
+    ctx->recover = outer;
+    return true;
+}
+
 Fl_Object *Fl_next_arg(Fl_Context *ctx, Fl_Object **arg) {
     Fl_Object *a = *arg;
     if (M_type(a) != T_PAIR) {
@@ -57,7 +101,7 @@ Fl_Object *Fl_next_arg(Fl_Context *ctx, Fl_Object **arg) {
     return M_first(a);
 }
 
-static Fl_Object *p_check_type(Fl_Context *ctx, Fl_Object *obj, Fl_Type type) {
+Fl_Object *Fl_check_type(Fl_Context *ctx, Fl_Object *obj, Fl_Type type) {
     if ((Fl_Type)M_type(obj) != type) {
         char buf[MAX_BUF_LEN];
         snprintf(buf, sizeof(buf), "expected %s but got %s", types[type], types[M_type(obj)]);
@@ -76,55 +120,67 @@ bool Fl_isnil(Fl_Context *ctx, Fl_Object *obj) {
     return M_isnil(obj);
 }
 
-static bool p_equal(Fl_Object *x, Fl_Object *y) {
+const char *Fl_type_name(Fl_Type type) {
+    return types[type];
+}
+
+bool Fl_equal(Fl_Context *ctx, Fl_Object *x, Fl_Object *y) {
+    M_unused(ctx);
     if (x == y)
         return true;
     if (M_type(x) != M_type(y))
         return false;
     if (M_type(x) == T_NUMBER)
         return M_number(x) == M_number(y);
-    if (M_type(x) == T_STRING) {
-        for (; !M_isnil(x); x = M_rest(x), y = M_rest(y))
-            if (M_first(x) != M_first(y))
+    if (M_type(x) == T_STRING)
+        return M_string(x)->len == M_string(y)->len && !memcmp(M_string(x)->data, M_string(y)->data, M_string(x)->len);
+    if (M_type(x) == T_VECTOR) {
+        if (M_vector(x)->len != M_vector(y)->len)
+            return false;
+        for (size_t i = 0; i < M_vector(x)->len; ++i) {
+            if (!Fl_equal(ctx, M_vector(x)->items[i], M_vector(y)->items[i]))
                 return false;
-        return x == y;
+        }
+        return true;
     }
     return false;
 }
 
 bool Fl_str_equal(Fl_Object *obj, const char *str) {
-    while (!M_isnil(obj)) {
-        for (int i = 0; i < STR_BUF_SIZE; ++i) {
-            if (M_strbuf(obj)[i] != *str)
-                return false;
-            if (*str)
-                ++str;
-        }
-        obj = M_rest(obj);
-    }
-    return !*str;
+    size_t len = strlen(str);
+    return M_string(obj)->len == len && !memcmp(M_string(obj)->data, str, len);
 }
 
 Fl_Object *Fl_object(Fl_Context *ctx) {
-    /* collect garbage if free list doesn't have any more objects */
-    if (M_isnil(ctx->free_list)) {
-        Fl_Gc_collect(ctx);
-        if (M_isnil(ctx->free_list))
-            Fl_error(ctx, "I'm out of memory :(");
-    }
-    /* get object from free list and push it to the stack */
     Fl_Object *obj = ctx->free_list;
-    ctx->free_list = M_rest(obj);
-    Fl_Gc_push(ctx, obj);
+    /* get object from free list, or from fresh heap space, and push it to the stack */
+    if (!M_isnil(obj))
+        ctx->free_list = M_rest(obj);
+    else
+        obj = Fl_Gc_alloc(ctx);
+    ++ctx->heap.allocated;
+    M_gcpush(ctx, obj);
     return obj;
 }
 
+int Fl_scope_open(Fl_Context *ctx) {
+    return ctx->gcstack_index;
+}
+
+/* let go of the objects made since `scope` was opened, but `result` (if any), which stays alive */
+Fl_Object *Fl_scope_close(Fl_Context *ctx, int scope, Fl_Object *result) {
+    Fl_Gc_restore(ctx, scope);
+    if (result)
+        M_gcpush(ctx, result);
+    return result;
+}
+
 Fl_Object *Fl_first(Fl_Context *ctx, Fl_Object *obj) {
-    return M_isnil(obj) ? obj : M_first(p_check_type(ctx, obj, T_PAIR));
+    return M_isnil(obj) ? obj : M_first(Fl_check_type(ctx, obj, T_PAIR));
 }
 
 Fl_Object *Fl_rest(Fl_Context *ctx, Fl_Object *obj) {
-    return M_isnil(obj) ? obj : M_rest(p_check_type(ctx, obj, T_PAIR));
+    return M_isnil(obj) ? obj : M_rest(Fl_check_type(ctx, obj, T_PAIR));
 }
 
 Fl_Object *Fl_list(Fl_Context *ctx, Fl_Object **objects, int n) {
@@ -134,67 +190,134 @@ Fl_Object *Fl_list(Fl_Context *ctx, Fl_Object **objects, int n) {
     return res;
 }
 
-static void p_str_write(Fl_Context *ctx, Fl_Write_fn wfn, void *data, const char *s) {
-    while (*s)
-        wfn(ctx, data, *s++);
+#define M_span(S) S, sizeof(S) - 1
+
+/* `n` the way "%.14g" has it, integers short enough to be printed in full are done by hand */
+static size_t p_format_number(Fl_Number n, char *buf, size_t size) {
+    if (n > -1e14 && n < 1e14 && n == (Fl_Number)(long long)n) {
+        char tmp[24], *end = tmp + sizeof(tmp), *p = end;
+        long long v = n;
+        unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+        do
+            *--p = '0' + u % 10;
+        while (u /= 10);
+        if (v < 0 || signbit(n))
+            *--p = '-';
+        memcpy(buf, p, end - p);
+        return end - p;
+    }
+    return snprintf(buf, size, "%.14g", n);
 }
 
-void Fl_write(Fl_Context *ctx, Fl_Object *obj, Fl_Write_fn wfn, void *data, bool with_quotes) {
+void Fl_write_spans(Fl_Context *ctx, Fl_Object *obj, Fl_Span_fn fn, void *data, bool with_quotes) {
     char buf[MAX_BUF_LEN / 2];
     switch (M_type(obj)) {
     case T_NIL:
-        p_str_write(ctx, wfn, data, "nil");
+        fn(ctx, data, M_span("nil"));
         break;
     case T_NUMBER:
-        snprintf(buf, sizeof(buf), "%.14g", M_number(obj));
-        p_str_write(ctx, wfn, data, buf);
+        fn(ctx, data, buf, p_format_number(M_number(obj), buf, sizeof(buf)));
         break;
     case T_PAIR:
-        wfn(ctx, data, '(');
+        fn(ctx, data, M_span("("));
         while (true) {
-            Fl_write(ctx, M_first(obj), wfn, data, true);
+            Fl_write_spans(ctx, M_first(obj), fn, data, true);
             obj = M_rest(obj);
             if (M_type(obj) != T_PAIR)
                 break;
-            wfn(ctx, data, ' ');
+            fn(ctx, data, M_span(" "));
         }
         if (!M_isnil(obj)) {
-            p_str_write(ctx, wfn, data, " . ");
-            Fl_write(ctx, obj, wfn, data, true);
+            fn(ctx, data, M_span(" . "));
+            Fl_write_spans(ctx, obj, fn, data, true);
         }
-        wfn(ctx, data, ')');
+        fn(ctx, data, M_span(")"));
         break;
     case T_SYMBOL:
-        Fl_write(ctx, M_first(M_rest(obj)), wfn, data, false);
+        Fl_write_spans(ctx, M_first(M_rest(obj)), fn, data, false);
         break;
-    case T_STRING:
-        if (with_quotes)
-            wfn(ctx, data, '"');
-        while (!M_isnil(obj)) {
-            for (int i = 0; i < STR_BUF_SIZE && M_strbuf(obj)[i]; ++i) {
-                if (with_quotes && M_strbuf(obj)[i] == '"')
-                    wfn(ctx, data, '\\');
-                wfn(ctx, data, M_strbuf(obj)[i]);
-            }
-            obj = M_rest(obj);
+    case T_VECTOR:
+        fn(ctx, data, M_span("["));
+        for (size_t i = 0; i < M_vector(obj)->len; ++i) {
+            if (i)
+                fn(ctx, data, M_span(" "));
+            Fl_write_spans(ctx, M_vector(obj)->items[i], fn, data, true);
+        }
+        fn(ctx, data, M_span("]"));
+        break;
+    case T_MAP: {
+        Fl_Object *key, *value;
+        fn(ctx, data, M_span("{"));
+        for (size_t i = 0, n = 0; Fl_Map_next(obj, &i, &key, &value); ++n) {
+            if (n)
+                fn(ctx, data, M_span(" "));
+            Fl_write_spans(ctx, key, fn, data, true);
+            fn(ctx, data, M_span(" "));
+            Fl_write_spans(ctx, value, fn, data, true);
+        }
+        fn(ctx, data, M_span("}"));
+        break;
+    }
+    case T_STRING: {
+        const char *s = M_string(obj)->data, *end = s + M_string(obj)->len, *q;
+        if (!with_quotes) {
+            fn(ctx, data, s, end - s);
+            break;
+        }
+        fn(ctx, data, M_span("\""));
+        for (; (q = memchr(s, '"', end - s)); s = q + 1) {
+            fn(ctx, data, s, q - s);
+            fn(ctx, data, M_span("\\\""));
         }
-        if (with_quotes)
-            wfn(ctx, data, '"');
+        fn(ctx, data, s, end - s);
+        fn(ctx, data, M_span("\""));
         break;
+    }
     default:
         snprintf(buf, sizeof(buf), "[%s at %p]", types[M_type(obj)], (void *)obj);
-        p_str_write(ctx, wfn, data, buf);
+        fn(ctx, data, buf, strlen(buf));
         break;
     }
 }
 
-static void p_writefp(Fl_Context *ctx, void *data, char c) {
-    M_unused(ctx);
-    fputc(c, data);
+typedef struct {
+    Fl_Write_fn fn;
+    void *data;
+} p_Chars;
+
+static void p_writechars(Fl_Context *ctx, void *data, const char *s, size_t len) {
+    p_Chars *ch = data;
+    while (len--)
+        ch->fn(ctx, ch->data, *s++);
+}
+
+/* the character at a time interface, on top of the spans one */
+void Fl_write(Fl_Context *ctx, Fl_Object *obj, Fl_Write_fn wfn, void *data, bool with_quotes) {
+    p_Chars ch = { wfn, data };
+    Fl_write_spans(ctx, obj, p_writechars, &ch, with_quotes);
+}
+
+static void p_flush(Fl_Context *ctx, FILE *fp) {
+    fwrite(ctx->out, 1, ctx->out_len, fp);
+    ctx->out_len = 0;
+}
+
+/* spans are gathered in the context's buffer and reach stdio a buffer at a time */
+static void p_writefp(Fl_Context *ctx, void *data, const char *s, size_t len) {
+    if (ctx->out_len + len > sizeof(ctx->out)) {
+        p_flush(ctx, data);
+        if (len > sizeof(ctx->out)) {
+            fwrite(s, 1, len, data);
+            return;
+        }
+    }
+    memcpy(ctx->out + ctx->out_len, s, len);
+    ctx->out_len += len;
 }
 
 void Fl_writefp(Fl_Context *ctx, Fl_Object *obj, FILE *fp) {
-    Fl_write(ctx, obj, p_writefp, fp, false);
+    Fl_write_spans(ctx, obj, p_writefp, fp, false);
+    p_flush(ctx, fp); /* whatever is written to `fp` next comes after it */
 }
 
 typedef struct {
@@ -202,398 +325,56 @@ typedef struct {
     int n;
 } p_StrInt;
 
-static void p_writebuf(Fl_Context *ctx, void *data, char c) {
+static void p_writebuf(Fl_Context *ctx, void *data, const char *s, size_t len) {
     M_unused(ctx);
     p_StrInt *si = data;
-    if (si->n) {
-        *si->s++ = c;
-        --si->n;
-    }
+    if (len > (size_t)si->n)
+        len = si->n;
+    memcpy(si->s, s, len);
+    si->s += len;
+    si->n -= len;
 }
 
 int Fl_to_string(Fl_Context *ctx, Fl_Object *obj, char *buf, int size) {
     p_StrInt si = { buf, size - 1 };
-    Fl_write(ctx, obj, p_writebuf, &si, false);
+    Fl_write_spans(ctx, obj, p_writebuf, &si, false);
     *si.s = '\0';
     return size - si.n - 1;
 }
 
 Fl_Number Fl_to_number(Fl_Context *ctx, Fl_Object *obj) {
-    return M_number(p_check_type(ctx, obj, T_NUMBER));
+    return M_number(Fl_check_type(ctx, obj, T_NUMBER));
 }
 
 void *Fl_to_ptr(Fl_Context *ctx, Fl_Object *obj) {
-    return M_rest(p_check_type(ctx, obj, T_PTR));
-}
-
-static Fl_Object *p_get_bound(Fl_Object *sym, Fl_Object *env) {
-    /* try to find the symbol in the "environment" first */
-    for (; !M_isnil(env); env = M_rest(env)) {
-        Fl_Object *o = M_first(env);
-        if (M_first(o) == sym)
-            return o;
-    }
-    /* symbol couldn't be found, return global */
-    return M_rest(sym);
+    return M_rest(Fl_check_type(ctx, obj, T_PTR));
 }
 
 void Fl_set(Fl_Context *ctx, Fl_Object *sym, Fl_Object *value) {
-    M_unused(ctx);
-    M_rest(p_get_bound(sym, &nil)) = value;
-}
-
-static Fl_Object rpr; /* ")" */
-
-static Fl_Object *p_read(Fl_Context *ctx, Fl_Read_fn rfn, void *data) {
-    Fl_Object *value, *res;
-
-    /* get next char */
-    int c = ctx->next_char ? ctx->next_char : rfn(ctx, data);
-    ctx->next_char = '\0';
-
-    /* skip whitespace, who needs it? */
-    while (c && strchr(" \n\t\r\v\f", c))
-        c = rfn(ctx, data);
-
-    switch (c) {
-    case '\0':
-        return NULL;
-    case '#': /* single-line comment */
-        while (c && c != '\n')
-            c = rfn(ctx, data);
-        return p_read(ctx, rfn, data); /* you gotta love seeing recursion */
-    case ')':
-        return &rpr;
-    case '(':
-        res = &nil;
-        Fl_Object **tail = &res;
-        int gc = Fl_Gc_save(ctx);
-        Fl_Gc_push(ctx, res); /* error on too-deep nesting */
-        while ((value = p_read(ctx, rfn, data)) != &rpr) {
-            if (value == NULL)
-                Fl_error(ctx, "list is missing a closing parenthesis ')', remember, you need to close it!");
-            if (M_type(value) == T_SYMBOL && Fl_str_equal(M_first(M_rest(value)), ".")) {
-                /* dotted pair */
-                *tail = Fl_read(ctx, rfn, data);
-            } else {
-                /* proper pair */
-                *tail = Fl_T_cons(ctx, value, &nil);
-                tail = &M_rest(*tail);
-            }
-            Fl_Gc_restore(ctx, gc);
-            Fl_Gc_push(ctx, res);
-        }
-        return res;
-    case '\'':
-        if (!(value = Fl_read(ctx, rfn, data)))
-            Fl_error(ctx, "unexpected quote (\"'\")");
-        return Fl_T_cons(ctx, Fl_T_symbol(ctx, "quote"), Fl_T_cons(ctx, value, &nil));
-    case '"':
-        res = Fl_str_make(ctx, NULL, '\0');
-        value = res;
-        c = rfn(ctx, data);
-        while (c != '"') {
-            if (c == '\0')
-                Fl_error(ctx, "string is missing a closing quote '\"'");
-            if (c == '\\') { /* escape sequences */
-                c = rfn(ctx, data);
-                if (strchr("nrt", c))
-                    c = strchr("n\nr\rt\t", c)[1];
-            }
-            value = Fl_str_make(ctx, value, c);
-            c = rfn(ctx, data);
-        }
-        return res;
-    default: {
-        /* notice that there's a space here, it's also a valid delimiter */
-        const char *const delimiters = "();\n\t\r ";
-        char buf[MAX_BUF_LEN], *s = buf;
-        do {
-            if (s == &buf[sizeof(buf) - 1])
-                Fl_error(ctx, "symbol is too long (do you really need THAT many character? ;))");
-            *s++ = c;
-            c = rfn(ctx, data);
-        } while (c && !strchr(delimiters, c));
-        *s = '\0';
-        ctx->next_char = c;
-        Fl_Number n = strtod(buf, &s); /* try to read as number */
-        if (s != buf && strchr(delimiters, *s))
-            return Fl_T_number(ctx, n);
-        if (strcmp(buf, "nil") == 0)
-            return &nil;
-        return Fl_T_symbol(ctx, buf);
-        }
-    }
-}
-
-Fl_Object *Fl_read(Fl_Context *ctx, Fl_Read_fn fn, void *data) {
-    Fl_Object *obj = p_read(ctx, fn, data);
-    if (obj == &rpr)
-        Fl_error(ctx, "unexpected parenthesis ')'");
-    return obj;
-}
-
-static char p_readfp(Fl_Context *ctx, void *data) {
-    M_unused(ctx);
-    int c;
-    return (c = fgetc(data)) != EOF ? c : '\0';
-}
-
-Fl_Object *Fl_readfp(Fl_Context *ctx, FILE *fp) {
-    return Fl_read(ctx, p_readfp, fp);
-}
-
-static Fl_Object *p_eval(Fl_Context *ctx, Fl_Object *obj, Fl_Object *env, Fl_Object **bind);
-
-static Fl_Object *p_eval_list(Fl_Context *ctx, Fl_Object *list, Fl_Object *env) {
-    Fl_Object *res = &nil, **tail = &res;
-    while (!M_isnil(list)) {
-        *tail = Fl_T_cons(ctx, p_eval(ctx, Fl_next_arg(ctx, &list), env, NULL), &nil);
-        tail = &M_rest(*tail);
-    }
-    return res;
-}
-
-static Fl_Object *do_list(Fl_Context *ctx, Fl_Object *list, Fl_Object *env) {
-    Fl_Object *res = &nil;
-    int save = Fl_Gc_save(ctx);
-    while (!M_isnil(list)) {
-        Fl_Gc_restore(ctx, save);
-        Fl_Gc_push(ctx, list);
-        Fl_Gc_push(ctx, env);
-        res = p_eval(ctx, Fl_next_arg(ctx, &list), env, &env);
-    }
-    return res;
-}
-
-static Fl_Object *args_to_env(Fl_Context *ctx, Fl_Object *prm, Fl_Object *arg, Fl_Object *env) {
-    while (!M_isnil(prm)) {
-        if (M_type(prm) != T_PAIR) {
-            env = Fl_T_cons(ctx, Fl_T_cons(ctx, prm, arg), env);
-            break;
-        }
-        env = Fl_T_cons(ctx, Fl_T_cons(ctx, M_first(prm), Fl_first(ctx, arg)), env);
-        prm = M_rest(prm);
-        arg = Fl_rest(ctx, arg);
-    }
-    return env;
-}
-
-#define eval_arg() \
-    p_eval(ctx, Fl_next_arg(ctx, &arg), env, NULL)
-
-#define arithmetic_op(op) {                          \
-        Fl_Number n = Fl_to_number(ctx, eval_arg()); \
-        while (!M_isnil(arg))                        \
-            n = n op Fl_to_number(ctx, eval_arg());  \
-        res = Fl_T_number(ctx, n);                   \
-    }
-
-#define relational_op(op)                                       \
-        val1 = p_check_type(ctx, eval_arg(), T_NUMBER);         \
-        val2 = p_check_type(ctx, eval_arg(), T_NUMBER);         \
-        res = Fl_T_bool(ctx, M_number(val1) op M_number(val2)); \
-
-static Fl_Object *p_eval(Fl_Context *ctx, Fl_Object *obj, Fl_Object *env, Fl_Object **new_env) {
-    Fl_Object cl, *val1, *val2;
-
-    if (M_type(obj) == T_SYMBOL)
-        return M_rest(p_get_bound(obj, env));
-    if (M_type(obj) != T_PAIR)
-        return obj;
-
-    M_first(&cl) = obj;
-    M_rest(&cl) = ctx->call_list;
-    ctx->call_list = &cl;
-
-    int gc = Fl_Gc_save(ctx);
-    Fl_Object *fn = p_eval(ctx, M_first(obj), env, NULL),
-        *arg = M_rest(obj),
-        *res = &nil;
-
-    switch (M_type(fn)) {
-    case T_BUILTIN:
-        switch (M_builtin(fn)) {
-        case BI_LET:
-            val1 = p_check_type(ctx, Fl_next_arg(ctx, &arg), T_SYMBOL);
-            if (new_env)
-                *new_env = Fl_T_cons(ctx, Fl_T_cons(ctx, val1, eval_arg()), env);
-            break;
-        case BI_SET:
-            val1 = p_check_type(ctx, Fl_next_arg(ctx, &arg), T_SYMBOL);
-            M_rest(p_get_bound(val1, env)) = eval_arg();
-            break;
-        case BI_IF:
-            while (!M_isnil(arg)) {
-                val1 = eval_arg();
-                if (!M_isnil(val1)) {
-                    res = M_isnil(arg) ? val1 : eval_arg();
-                    break;
-                }
-                if (M_isnil(arg))
-                    break;
-                arg = M_rest(arg);
-            }
-            break;
-        case BI_FN:
-        case BI_MACRO:
-            val1 = Fl_T_cons(ctx, env, arg);
-            Fl_next_arg(ctx, &arg);
-            res = Fl_object(ctx);
-            M_settype(res, M_builtin(fn) == BI_FN ? T_FUNC : T_MACRO);
-            M_rest(res) = val1;
-            break;
-        case BI_USE: {
-            char file_name[MAX_BUF_LEN * 16]; /* 1KB, a pretty sensible buffer size */
-            val1 = p_check_type(ctx, eval_arg(), T_STRING);
-            Fl_to_string(ctx, val1, file_name, sizeof(file_name));
-            FILE *fp = fopen(file_name, "r");
-            if (!fp)
-                Fl_error(ctx, "could not load file");
-            Fl_run_file(ctx, fp);
-            break;
-        }
-        case BI_WHILE:
-            val1 = Fl_next_arg(ctx, &arg);
-            int n = Fl_Gc_save(ctx);
-            while (!M_isnil(p_eval(ctx, val1, env, NULL))) {
-                do_list(ctx, arg, env);
-                Fl_Gc_restore(ctx, n);
-            }
-            break;
-        case BI_QUOTE:
-            res = Fl_next_arg(ctx, &arg);
-            break;
-        case BI_EVAL:
-            val1 = p_check_type(ctx, Fl_next_arg(ctx, &arg), T_PAIR);
-            res = do_list(ctx, val1, env);
-            break;
-        case BI_TYPE:
-            res = Fl_T_string(ctx, types[Fl_type(ctx, eval_arg())]);
-            break;
-        case BI_AND:
-            while (!M_isnil(arg) && !M_isnil(res = eval_arg()));
-            break;
-        case BI_OR:
-            while (!M_isnil(arg) && M_isnil(res = eval_arg()));
-            break;
-        case BI_DO:
-            res = do_list(ctx, arg, env);
-            break;
-        case BI_CONS:
-            val1 = eval_arg();
-            res = Fl_T_cons(ctx, val1, eval_arg());
-            break;
-        case BI_FIRST:
-            res = Fl_first(ctx, eval_arg());
-            break;
-        case BI_REST:
-            res = Fl_rest(ctx, eval_arg());
-            break;
-        case BI_SETF:
-            val1 = p_check_type(ctx, eval_arg(), T_PAIR);
-            M_first(val1) = eval_arg();
-            break;
-        case BI_SETR:
-            val1 = p_check_type(ctx, eval_arg(), T_PAIR);
-            M_rest(val1) = eval_arg();
-            break;
-        case BI_LIST:
-            res = p_eval_list(ctx, arg, env);
-            break;
-        case BI_NOT:
-            res = Fl_T_bool(ctx, M_isnil(eval_arg()));
-            break;
-        case BI_ATOM:
-            res = Fl_T_bool(ctx, Fl_type(ctx, eval_arg()) != T_PAIR);
-            break;
-        case BI_PRINT:
-            while (!M_isnil(arg)) {
-                Fl_writefp(ctx, eval_arg(), stdout);
-                if (!M_isnil(arg))
-                    fputs(" ", stdout);
-            }
-            break;
-        case BI_EQ:
-            val1 = eval_arg();
-            res = Fl_T_bool(ctx, p_equal(val1, eval_arg()));
-            break;
-        case BI_LT:
-            relational_op(<);
-            break;
-        case BI_LE:
-            relational_op(<=);
-            break;
-        case BI_GT:
-            relational_op(>);
-            break;
-        case BI_GE:
-            relational_op(>=);
-            break;
-        case BI_ADD:
-            arithmetic_op(+);
-            break;
-        case BI_SUB:
-            arithmetic_op(-);
-            break;
-        case BI_MUL:
-            arithmetic_op(*);
-            break;
-        case BI_DIV:
-            arithmetic_op(/);
-            break;
-        }
-        break;
-    case T_CFUNC:
-        res = M_cfunc(fn)(ctx, p_eval_list(ctx, arg, env));
-        break;
-    case T_FUNC:
-        arg = p_eval_list(ctx, arg, env);
-        val1 = M_rest(fn);   /* (env params ...) */
-        val2 = M_rest(val1); /* (params ...)    */
-        res = do_list(ctx, M_rest(val2), args_to_env(ctx, M_first(val2), arg, M_first(val1)));
-        break;
-    case T_MACRO:
-        val1 = M_rest(fn);   /* (env params ...) */
-        val2 = M_rest(val1); /* (params ...)    */
-        /* replace caller object with code generated by macro & re-evaluate */
-        *obj = *do_list(ctx, M_rest(val2), args_to_env(ctx, M_first(val2), arg, M_first(val1)));
-        Fl_Gc_restore(ctx, gc);
-        ctx->call_list = M_rest(&cl);
-        return p_eval(ctx, obj, env, NULL);
-    default:
-        Fl_error(ctx, "cannot call non-callable value");
-    }
-    Fl_Gc_restore(ctx, gc);
-    Fl_Gc_push(ctx, res);
-    ctx->call_list = M_rest(&cl);
-    return res;
+    Fl_Object *old = M_rest(M_rest(sym));
+    int type = M_type(old);
+    /* call sites may have this binding cached, see Fl_Cache */
+    if (old != value && (type == T_FUNC || type == T_BUILTIN || type == T_CFUNC))
+        ++ctx->symtab.version;
+    M_rest(M_rest(sym)) = value;
+    M_barrier(ctx, M_rest(sym));
 }
 
 Fl_Object *Fl_eval(Fl_Context *ctx, Fl_Object *obj) {
-    return p_eval(ctx, obj, &nil, NULL);
+    return Fl_exec(ctx, Fl_compile(ctx, obj));
 }
 
-Fl_Context *Fl_open(void *ptr, int size) {
+/* `heap_size` limits how big the heap may grow in bytes, 0 means no limit */
+Fl_Context *Fl_open(size_t heap_size) {
     /* initialize context struct */
-    Fl_Context *ctx = ptr;
-    memset(ctx, 0, sizeof(Fl_Context));
-    ptr = (char *)ptr + sizeof(Fl_Context);
-    size -= sizeof(Fl_Context);
-
-    /* initialize objects memory region */
-    ctx->objects = (Fl_Object *)ptr;
-    ctx->nobject = size / sizeof(Fl_Object);
-    /* initialize lists */
-    ctx->call_list = ctx->free_list = ctx->sym_list = &nil;
-
-    /* populate free list */
-    for (int i = 0; i < ctx->nobject; ++i) {
-        Fl_Object *obj = &ctx->objects[i];
-        M_settype(obj, T_FREE);
-        M_rest(obj) = ctx->free_list;
-        ctx->free_list = obj;
-    }
+    Fl_Context *ctx = calloc(1, sizeof(Fl_Context));
+    if (!ctx)
+        return NULL;
+
+    /* the heap starts empty and grows a segment at a time */
+    Fl_Gc_init(ctx, heap_size);
+    Fl_Symtab_init(ctx);
+    Fl_Vm_init(ctx);
 
     /* initialize objects */
     ctx->t = Fl_T_symbol(ctx, "t");
@@ -612,18 +393,37 @@ Fl_Context *Fl_open(void *ptr, int size) {
 }
 
 void Fl_close(Fl_Context *ctx) {
-    /* clear gcstack and symbol list, which makes all objects unreachable */
+    Fl_Prof_stop(ctx);
+    Fl_Pool_free(ctx);
+    /* clear gcstack and symbol table, which makes all objects unreachable */
     ctx->gcstack_index = 0;
-    ctx->sym_list = &nil;
+    Fl_Symtab_free(ctx);
+    Fl_Vm_free(ctx);
+    p_close_sources(ctx, NULL);
+    /* a marking in progress would keep what it already found, finish it and collect again */
+    if (ctx->heap.marking)
+        Fl_Gc_collect(ctx);
     Fl_Gc_collect(ctx);
+    Fl_Gc_free(ctx);
+    free(ctx->scratch);
+    free(ctx);
 }
 
 void Fl_run_file(Fl_Context *ctx, FILE *fp) {
-    int gc_index = Fl_Gc_save(ctx);
+    Fl_Source *src = malloc(sizeof(*src));
+    if (!src) {
+        fclose(fp);
+        Fl_error(ctx, "I'm out of memory :(");
+    }
+    src->fp = fp;
+    src->outer = ctx->sources;
+    Fl_reader_file(&src->in, fp);
+    ctx->sources = src;
+    int scope = Fl_scope_open(ctx);
     Fl_Object *obj;
-    while ((obj = Fl_readfp(ctx, fp))) {
-        Fl_eval(ctx, obj);
-        Fl_Gc_restore(ctx, gc_index);
+    while ((obj = Fl_read_from(ctx, &src->in))) {
+        Fl_exec(ctx, Fl_optimize(ctx, obj));
+        Fl_scope_close(ctx, scope, NULL);
     }
-    fclose(fp);
+    p_close_sources(ctx, src->outer);
 }
@@ -1,12 +1,46 @@
+#include <string.h>
+#include <time.h>
+
 #include "gc.h"
+#include "symtab.h"
+#include "vm.h"
+#include "map.h"
+
+/*
+ * Generational mark and sweep. Objects never move: a cell is young until it survives its first
+ * collection, which sets its bit in the segment's `old` bitmap. Minor collections only mark
+ * young objects, starting from the roots and from the remembered set (old objects the write
+ * barrier saw being stored into), and only sweep the segments allocated from since the last
+ * collection. Full collections mark and sweep everything.
+ *
+ * Sweeping is lazy: a collection only marks, then allocations sweep the segments it left behind
+ * one at a time, until they find one with room, at most `sweep_budget` cells a go.
+ *
+ * Full collections can mark incrementally too, in steps of at most `step_us` microseconds taken
+ * each time allocation moves to another segment. Marked objects are black once their fields are
+ * marked, grey until then (on the mark stack), the rest is white. The write barrier turns black
+ * objects grey again when they're stored into, and the last step marks from the roots once more,
+ * which covers everything the mutator did in between without a barrier.
+ */
 
 void Fl_Gc_push(Fl_Context *ctx, Fl_Object *obj) {
-    if (ctx->gcstack_index == GC_MAX_STACK_SIZE)
-        Fl_error(ctx, "garbage collector stack overflow :(\n");
+    if (ctx->gcstack_index == ctx->gcstack_cap) {
+        int cap = ctx->gcstack_cap ? ctx->gcstack_cap * 2 : GC_STACK_SIZE;
+        Fl_Object **gcstack = NULL;
+        if (cap <= GC_MAX_STACK_SIZE)
+            gcstack = realloc(ctx->gcstack, cap * sizeof(*gcstack));
+        if (!gcstack)
+            Fl_error(ctx, "garbage collector stack overflow :(\n");
+        ctx->gcstack = gcstack;
+        ctx->gcstack_cap = cap;
+    }
     ctx->gcstack[ctx->gcstack_index++] = obj;
 }
 
 void Fl_Gc_restore(Fl_Context *ctx, int index) {
+    /* it only ever goes down here, so the deepest it went is seen here (or is where it is now) */
+    if (ctx->gcstack_index > ctx->gcstack_max)
+        ctx->gcstack_max = ctx->gcstack_index;
     ctx->gcstack_index = index;
 }
 
@@ -14,48 +48,530 @@ int Fl_Gc_save(Fl_Context *ctx) {
     return ctx->gcstack_index;
 }
 
-void Fl_Gc_mark(Fl_Context *ctx, Fl_Object *obj) {
-begin:
-    if (M_tag(obj) & GC_MARKBIT)
-        return;
-    Fl_Object *car = M_first(obj); /* store car before modifying it with GC_MARKBIT */
-    M_tag(obj) |= GC_MARKBIT;
+static double p_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
+/* mark everything `obj` refers to */
+static void p_mark_fields(Fl_Context *ctx, Fl_Object *obj) {
     switch (M_type(obj)) {
     case T_PAIR:
-        Fl_Gc_mark(ctx, car);
+        Fl_Gc_mark(ctx, M_first(obj));
         /* FALLTHROUGH */
     case T_FUNC:
     case T_MACRO:
     case T_SYMBOL:
-    case T_STRING:
-        obj = M_rest(obj);
-        goto begin;
+        Fl_Gc_mark(ctx, M_rest(obj));
+        break;
     case T_PTR:
         if (ctx->handlers.mark)
             ctx->handlers.mark(ctx, obj);
         break;
+    case T_CODE:
+        Fl_Code_mark(ctx, obj);
+        break;
+    case T_FRAME:
+        if (!M_frame(obj))
+            break;
+        for (int i = 0; i < M_frame(obj)->n; ++i)
+            Fl_Gc_mark(ctx, M_frame(obj)->slots[i]);
+        Fl_Gc_mark(ctx, M_frame(obj)->parent);
+        break;
+    case T_VECTOR:
+        /* the items go on the mark stack, however many there are */
+        if (M_vector(obj)) {
+            for (size_t i = 0; i < M_vector(obj)->len; ++i)
+                Fl_Gc_mark(ctx, M_vector(obj)->items[i]);
+        }
+        break;
+    case T_MAP:
+        Fl_Map_mark(ctx, obj);
+        break;
     }
 }
 
-void Fl_Gc_collect(Fl_Context *ctx) {
-    /* mark all */
+/* set the mark bit of `obj`, false if it was already set or doesn't need to be */
+static bool p_setmark(Fl_Heap *heap, Fl_Object *obj) {
+    if (M_isnil(obj) || M_isimm(obj))
+        return false;
+    Fl_Segment *seg = M_segment(obj);
+    int slot = M_slot(obj);
+    /* a minor collection takes old objects as alive, their young fields come from the remembered set */
+    if (M_bit(seg->mark, slot) || (!heap->full && M_bit(seg->old, slot)))
+        return false;
+    M_bitset(seg->mark, slot);
+    /* promote right away, the barrier has to see stores into survivors before they're swept */
+    M_bitset(seg->old, slot);
+    ++heap->marked;
+    return true;
+}
+
+static void p_push(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Heap *heap = &ctx->heap;
+    if (heap->nmarks == heap->capmarks) {
+        size_t cap = heap->capmarks ? heap->capmarks * 2 : 1024;
+        Fl_Object **marks = realloc(heap->marks, cap * sizeof(*marks));
+        if (!marks)
+            Fl_error(ctx, "I'm out of memory :(");
+        heap->marks = marks;
+        heap->capmarks = cap;
+    }
+    heap->marks[heap->nmarks++] = obj;
+}
+
+/* set the mark bit of `obj`, its fields get marked later on by p_drain */
+void Fl_Gc_mark(Fl_Context *ctx, Fl_Object *obj) {
+    if (!p_setmark(&ctx->heap, obj))
+        return;
+    int type = M_type(obj);
+    if (type == T_NUMBER || type == T_STRING || type == T_BUILTIN || type == T_CFUNC)
+        return; /* nothing to follow */
+    p_push(ctx, obj);
+}
+
+/* mark until the mark stack runs out, false if `deadline` (0 for none) comes first */
+static bool p_drain(Fl_Context *ctx, double deadline) {
+    Fl_Heap *heap = &ctx->heap;
+    unsigned work = 0;
+    while (heap->nmarks) {
+        Fl_Object *obj = heap->marks[--heap->nmarks];
+        /* the barrier made it grey again */
+        if (!M_bit(M_segment(obj)->mark, M_slot(obj)) && !p_setmark(heap, obj))
+            continue;
+        /* lists are followed along their rests without going through the stack */
+        while (M_type(obj) == T_PAIR) {
+            Fl_Gc_mark(ctx, M_first(obj));
+            obj = M_rest(obj);
+            if (!p_setmark(heap, obj))
+                goto next;
+            if (deadline && !(++work & 255) && p_now() >= deadline) {
+                p_push(ctx, obj);
+                return false;
+            }
+        }
+        p_mark_fields(ctx, obj);
+    next:
+        if (deadline && !(++work & 255) && p_now() >= deadline)
+            return !heap->nmarks;
+    }
+    return true;
+}
+
+/* whether `obj` survives the collection in progress, once marking is done */
+bool Fl_Gc_marked(Fl_Context *ctx, Fl_Object *obj) {
+    return M_bit(M_segment(obj)->mark, M_slot(obj)) || (!ctx->heap.full && M_isold(obj));
+}
+
+/* write barrier slow path, `obj` is old and not remembered yet or marking is in progress */
+void Fl_Gc_store(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Heap *heap = &ctx->heap;
+    Fl_Segment *seg = M_segment(obj);
+    int slot = M_slot(obj);
+    /* a black object may point to a white one now */
+    if (heap->marking && M_bit(seg->mark, slot)) {
+        M_bitclear(seg->mark, slot);
+        --heap->marked;
+        p_push(ctx, obj);
+    }
+    if (!M_bit(seg->old, slot) || M_bit(seg->remembered, slot))
+        return;
+    if (heap->nremembered == heap->capremembered) {
+        size_t cap = heap->capremembered ? heap->capremembered * 2 : 256;
+        Fl_Object **remembered = realloc(heap->remembered, cap * sizeof(*remembered));
+        if (!remembered)
+            Fl_error(ctx, "I'm out of memory :(");
+        heap->remembered = remembered;
+        heap->capremembered = cap;
+    }
+    heap->remembered[heap->nremembered++] = obj;
+    M_bitset(seg->remembered, slot);
+}
+
+void Fl_Gc_barrier(Fl_Context *ctx, Fl_Object *obj) {
+    if (!M_isnil(obj) && !M_isimm(obj))
+        M_barrier(ctx, obj);
+}
+
+static void p_free_cell(Fl_Context *ctx, Fl_Object *obj) {
+    if (M_type(obj) == T_PTR && ctx->handlers.gc)
+        ctx->handlers.gc(ctx, obj);
+    if (M_type(obj) == T_STRING)
+        free(M_string(obj));
+    if (M_type(obj) == T_VECTOR)
+        free(M_vector(obj));
+    if (M_type(obj) == T_MAP)
+        Fl_Map_free(obj);
+    if (M_type(obj) == T_CODE)
+        Fl_Code_free(obj);
+    if (M_type(obj) == T_FRAME)
+        Fl_Frame_free(ctx, obj);
+    ++ctx->heap.freed[M_type(obj)];
+    M_settype(obj, T_FREE);
+}
+
+/* bits of bitmap word `w` that stand for slots in [lo, hi) */
+static uint64_t p_range(int w, int lo, int hi) {
+    int from = lo - w * 64, to = hi - w * 64;
+    uint64_t mask = to >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << to) - 1;
+    return from > 0 ? mask & ~(((uint64_t)1 << from) - 1) : mask;
+}
+
+/* cells handed out and not swept up yet */
+static size_t p_in_use(Fl_Heap *heap) {
+    size_t freed = 0;
+    for (int t = 0; t < FL_NTYPES; ++t)
+        freed += heap->freed[t];
+    return heap->allocated - freed;
+}
+
+/* rebuild the free list of `seg` */
+static void p_sweep(Fl_Context *ctx, Fl_Segment *seg) {
+    Fl_Object *base = (Fl_Object *)seg;
+    /* only allocation adds to the cells in use, the most there were is where sweeping starts */
+    size_t in_use = p_in_use(&ctx->heap);
+    if (in_use > ctx->heap.in_use_max)
+        ctx->heap.in_use_max = in_use;
+    int end = (int)(seg->top - base), top = end;
+    bool tail = true;
+    seg->free = &nil;
+    seg->nfree = 0;
+    /* a word at a time from the top down, dead cells past the last live one go back to bump allocation */
+    for (int w = (end - 1) / 64; w >= GC_HEADER_SLOTS / 64; --w) {
+        /* marking set the old bits of the survivors already */
+        uint64_t alive = ctx->heap.sweep_full ? seg->mark[w] : seg->old[w];
+        uint64_t dead = ~alive & p_range(w, GC_HEADER_SLOTS, end);
+        seg->old[w] = alive;
+        seg->mark[w] = 0;
+        if (tail) {
+            top = alive ? w * 64 + 64 - __builtin_clzll(alive) : w * 64;
+            tail = !alive;
+        }
+        for (; dead; dead &= dead - 1) {
+            Fl_Object *obj = base + w * 64 + __builtin_ctzll(dead);
+            if (M_type(obj) != T_FREE)
+                p_free_cell(ctx, obj);
+            if (obj - base < top) {
+                M_rest(obj) = seg->free;
+                seg->free = obj;
+                ++seg->nfree;
+            }
+        }
+    }
+    seg->top = base + (top > GC_HEADER_SLOTS ? top : GC_HEADER_SLOTS);
+}
+
+static Fl_Segment *p_sweep_next(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    Fl_Segment *seg = heap->unswept;
+    heap->unswept = seg->next_unswept;
+    seg->unswept = false;
+    p_sweep(ctx, seg);
+    return seg;
+}
+
+static void p_pause(Fl_Heap *heap, double start) {
+    double pause = p_now() - start;
+    int bucket = 0;
+    for (double us = pause * 1e6; us >= 2 && bucket < GC_PAUSE_BUCKETS - 1; us /= 2)
+        ++bucket;
+    ++heap->pauses[bucket];
+    heap->pause_total += pause;
+    if (pause > heap->pause_max)
+        heap->pause_max = pause;
+}
+
+static void p_mark_roots(Fl_Context *ctx) {
     for (int i = 0; i < ctx->gcstack_index; ++i)
         Fl_Gc_mark(ctx, ctx->gcstack[i]);
-    Fl_Gc_mark(ctx, ctx->sym_list);
-    /* sweep and unmark */
-    for (int i = 0; i < ctx->nobject; ++i) {
-        Fl_Object *obj = &ctx->objects[i];
-        if (M_type(obj) == T_FREE)
-            continue; /* nothing to do, move on */
-        if (~M_tag(obj) & GC_MARKBIT) {
-            if (M_type(obj) == T_PTR && ctx->handlers.gc)
-                ctx->handlers.gc(ctx, obj);
-            M_settype(obj, T_FREE);
-            M_rest(obj) = ctx->free_list;
-            ctx->free_list = obj;
-        } else {
-            M_tag(obj) &= ~GC_MARKBIT;
+    Fl_Vm_mark(ctx);
+    Fl_Symtab_mark(ctx);
+}
+
+/* start a collection by marking from the roots */
+static void p_begin(Fl_Context *ctx, bool full) {
+    Fl_Heap *heap = &ctx->heap;
+
+    /* the mark bits left over by the previous collection go first */
+    while (heap->unswept)
+        p_sweep_next(ctx);
+
+    /* allocation restarts from a fresh pick of segments afterwards */
+    if (heap->current)
+        heap->current->top = heap->bump;
+    heap->current = NULL;
+    heap->bump = heap->end = NULL;
+    ctx->free_list = &nil;
+    heap->cursor = heap->segments;
+    heap->full = full;
+    heap->marked = 0;
+
+    p_mark_roots(ctx);
+    for (size_t i = 0; i < heap->nremembered; ++i) {
+        Fl_Object *obj = heap->remembered[i];
+        M_bitclear(M_segment(obj)->remembered, M_slot(obj));
+        if (!full)
+            p_mark_fields(ctx, obj);
+    }
+    heap->nremembered = 0;
+}
+
+/* mark whatever is left and hand the segments over to the lazy sweep */
+static void p_finish(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    bool full = heap->full;
+
+    /* roots don't have a barrier, what they point to now may still be white */
+    if (heap->marking)
+        p_mark_roots(ctx);
+    p_drain(ctx, 0);
+    Fl_Symtab_sweep(ctx);
+
+    /* only segments allocated from since the last collection hold young objects */
+    if (full) {
+        for (Fl_Segment *seg = heap->segments; seg; seg = seg->next) {
+            seg->unswept = true;
+            seg->next_unswept = heap->unswept;
+            heap->unswept = seg;
+        }
+        heap->old = heap->marked;
+        /* leave room for the live data to grow before the next full collection */
+        heap->full_at = heap->old * GC_GROWTH > GC_NURSERY_CELLS ? heap->old * GC_GROWTH : GC_NURSERY_CELLS;
+        size_t target = (heap->full_at + GC_NURSERY_CELLS) / (GC_SEGMENT_SLOTS - GC_HEADER_SLOTS) + 1;
+        heap->target = target < heap->limit ? target : heap->limit;
+    } else {
+        heap->old += heap->marked;
+    }
+    for (; heap->young; heap->young = heap->young->next_young) {
+        heap->young->young = false;
+        if (!full) {
+            heap->young->unswept = true;
+            heap->young->next_unswept = heap->unswept;
+            heap->unswept = heap->young;
         }
     }
+    heap->sweep_full = full;
+    heap->nursery = 0;
+    heap->full = heap->marking = false;
+    ++heap->collections[full];
+}
+
+static void p_collect(Fl_Context *ctx, bool full) {
+    double start = p_now();
+    p_begin(ctx, full || !ctx->heap.generational);
+    p_finish(ctx);
+    p_pause(&ctx->heap, start);
+}
+
+/* start a full collection that marks a step at a time */
+static void p_start_marking(Fl_Context *ctx) {
+    double start = p_now();
+    p_begin(ctx, true);
+    ctx->heap.marking = true;
+    p_pause(&ctx->heap, start);
+}
+
+static void p_step(Fl_Context *ctx) {
+    double start = p_now();
+    if (p_drain(ctx, start + ctx->heap.step_us / 1e6))
+        p_finish(ctx);
+    p_pause(&ctx->heap, start);
+}
+
+void Fl_Gc_collect(Fl_Context *ctx) {
+    if (ctx->heap.marking) {
+        double start = p_now();
+        p_finish(ctx);
+        p_pause(&ctx->heap, start);
+    } else {
+        p_collect(ctx, true);
+    }
+}
+
+static void p_use_segment(Fl_Context *ctx, Fl_Segment *seg) {
+    Fl_Heap *heap = &ctx->heap;
+    heap->current = seg;
+    heap->bump = seg->top;
+    heap->end = M_cells_end(seg);
+    heap->nursery += seg->nfree + (heap->end - heap->bump);
+    ctx->free_list = seg->free;
+    seg->free = &nil;
+    seg->nfree = 0;
+    if (!seg->young) {
+        seg->young = true;
+        seg->next_young = heap->young;
+        heap->young = seg;
+    }
+}
+
+static bool p_add_segment(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    void *mem;
+    if (heap->nsegments >= heap->limit || posix_memalign(&mem, GC_SEGMENT_SIZE, GC_SEGMENT_SIZE))
+        return false;
+    Fl_Segment *seg = mem;
+    memset(seg, 0, sizeof(Fl_Segment));
+    seg->free = &nil;
+    seg->top = M_cells(seg);
+    seg->next = heap->segments;
+    heap->segments = seg;
+    ++heap->nsegments;
+    p_use_segment(ctx, seg);
+    return true;
+}
+
+/* switch to the next segment with at least `min` cells to spare */
+static bool p_next_segment(Fl_Context *ctx, int min) {
+    Fl_Heap *heap = &ctx->heap;
+    for (Fl_Segment *seg; (seg = heap->cursor); ) {
+        heap->cursor = seg->next;
+        if (seg != heap->current && !seg->unswept && seg->nfree + (M_cells_end(seg) - seg->top) >= min) {
+            p_use_segment(ctx, seg);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* sweep until a segment has room, giving up after `budget` cells (0 for no limit) */
+static bool p_sweep_some(Fl_Context *ctx, size_t budget) {
+    Fl_Heap *heap = &ctx->heap;
+    double start = p_now();
+    size_t cells = 0;
+    bool found = false;
+    while (heap->unswept && !found && (!budget || cells < budget)) {
+        Fl_Segment *seg = p_sweep_next(ctx);
+        cells += seg->top - M_cells(seg);
+        if (seg->nfree + (M_cells_end(seg) - seg->top) >= GC_MIN_FREE) {
+            p_use_segment(ctx, seg);
+            found = true;
+        }
+    }
+    double elapsed = p_now() - start;
+    heap->sweep_total += elapsed;
+    if (elapsed > heap->sweep_max)
+        heap->sweep_max = elapsed;
+    return found;
+}
+
+static bool p_refill(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    /* no collection can happen while marking, the heap grows instead, up to twice the target before
+       the marking has to be finished at once */
+    bool grow = heap->nsegments < (heap->marking ? 2 * heap->target : heap->target);
+    if (p_next_segment(ctx, GC_MIN_FREE))
+        return true;
+    if (!heap->unswept)
+        return grow && p_add_segment(ctx);
+    /* sweeping over budget only when the heap can't grow */
+    return p_sweep_some(ctx, heap->sweep_budget) || (grow && p_add_segment(ctx)) || p_sweep_some(ctx, 0);
+}
+
+/* allocation slow path, taken once the current segment runs dry */
+Fl_Object *Fl_Gc_alloc(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    if (heap->bump == heap->end) {
+        if (heap->current)
+            heap->current->top = heap->bump;
+        heap->current = NULL;
+        /* incremental marking keeps pace with allocation, a step per segment handed out */
+        if (heap->marking)
+            p_step(ctx);
+        if (heap->marking) {
+            if (!p_refill(ctx)) {
+                Fl_Gc_collect(ctx);
+                p_refill(ctx);
+            }
+        } else if (heap->nursery >= GC_NURSERY_CELLS || !p_refill(ctx)) {
+            bool full = heap->old >= heap->full_at || !heap->generational;
+            if (full && heap->step_us) {
+                p_start_marking(ctx);
+                if (!p_refill(ctx)) {
+                    Fl_Gc_collect(ctx);
+                    p_refill(ctx);
+                }
+            } else {
+                p_collect(ctx, full);
+                /* young garbage wasn't enough, look at everything before growing past the target */
+                if (!p_refill(ctx) && !full) {
+                    p_collect(ctx, true);
+                    p_refill(ctx);
+                }
+            }
+        }
+        if (!heap->current && !p_add_segment(ctx)) {
+            heap->cursor = heap->segments;
+            if (!p_next_segment(ctx, 1))
+                Fl_error(ctx, "I'm out of memory :(");
+        }
+        if (!M_isnil(ctx->free_list)) {
+            Fl_Object *obj = ctx->free_list;
+            ctx->free_list = M_rest(obj);
+            return obj;
+        }
+    }
+    return heap->bump++;
+}
+
+/* fill `stats` with what the heap of `ctx` went through so far */
+void Fl_Gc_stats(Fl_Context *ctx, Fl_Gc_Stats *stats) {
+    Fl_Heap *heap = &ctx->heap;
+    memset(stats, 0, sizeof(*stats));
+    /* a cell keeps the type it was made with until it's swept up, so the ones made are those freed
+       and those still there */
+    for (Fl_Segment *seg = heap->segments; seg; seg = seg->next) {
+        Fl_Object *end = seg == heap->current ? heap->bump : seg->top;
+        for (Fl_Object *obj = M_cells(seg); obj < end; ++obj) {
+            if (M_type(obj) != T_FREE)
+                ++stats->allocated[M_type(obj)];
+        }
+        stats->cells += GC_SEGMENT_SLOTS - GC_HEADER_SLOTS;
+    }
+    for (int t = 0; t < FL_NTYPES; ++t) {
+        stats->allocated[t] += heap->freed[t];
+        stats->freed[t] = heap->freed[t];
+    }
+    stats->collections[0] = heap->collections[0];
+    stats->collections[1] = heap->collections[1];
+    stats->pause_total = heap->pause_total;
+    stats->pause_max = heap->pause_max;
+    stats->in_use = p_in_use(heap);
+    stats->in_use_max = stats->in_use > heap->in_use_max ? stats->in_use : heap->in_use_max;
+    stats->survived = heap->old;
+    stats->limit = heap->limit == (size_t)-1 ? 0 : heap->limit * (GC_SEGMENT_SLOTS - GC_HEADER_SLOTS);
+    stats->gcstack_max = ctx->gcstack_index > ctx->gcstack_max ? ctx->gcstack_index : ctx->gcstack_max;
+}
+
+/* `size` is the most bytes the heap may take, 0 for no limit */
+void Fl_Gc_init(Fl_Context *ctx, size_t size) {
+    Fl_Heap *heap = &ctx->heap;
+    heap->limit = size ? (size + GC_SEGMENT_SIZE - 1) / GC_SEGMENT_SIZE : (size_t)-1;
+    heap->full_at = GC_NURSERY_CELLS;
+    heap->target = 2 * GC_NURSERY_CELLS / (GC_SEGMENT_SLOTS - GC_HEADER_SLOTS) + 1;
+    if (heap->target > heap->limit)
+        heap->target = heap->limit;
+    heap->generational = true;
+    heap->sweep_budget = GC_SWEEP_BUDGET;
+    heap->step_us = GC_STEP_US;
+    ctx->free_list = &nil;
+}
+
+void Fl_Gc_free(Fl_Context *ctx) {
+    Fl_Heap *heap = &ctx->heap;
+    /* what the last collection found dead still holds memory off the heap */
+    while (heap->unswept)
+        p_sweep_next(ctx);
+    while (heap->segments) {
+        Fl_Segment *seg = heap->segments;
+        heap->segments = seg->next;
+        free(seg);
+    }
+    free(heap->remembered);
+    free(heap->marks);
+    memset(heap, 0, sizeof(*heap));
+    free(ctx->gcstack);
+    ctx->gcstack = NULL;
+    ctx->gcstack_index = ctx->gcstack_cap = ctx->gcstack_max = 0;
+    ctx->free_list = &nil;
 }
@@ -0,0 +1,580 @@
+/* Heap images, the global bindings and everything they reach, saved to a file and loaded back; the
+   same encoding moves objects between contexts in memory */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "type.h"
+#include "gc.h"
+#include "symtab.h"
+#include "vm.h"
+#include "map.h"
+
+#define IMAGE_MAGIC "FLIMAGE1"
+#define IMAGE_BUILD FL_VERSION " " __DATE__ " " __TIME__ /* an image is only good for the build that made it */
+
+/*
+ * An image is a header, the offsets of the objects' records, and the records. A record is the
+ * object's type followed by its contents, all in 64 bit words; references to other objects are
+ * their number in the image, so nothing depends on where the heap was
+ */
+typedef struct {
+    char magic[8];
+    char build[48];
+    uint64_t layout; /* where the code is relative to Fl_open, C functions are saved as offsets */
+    uint64_t cell_size;
+    uint64_t nobjects;
+    uint64_t size; /* of the whole file */
+} p_Header;
+
+/* in memory there's no header, the pack starts with the root and the number of objects instead */
+#define PACK_WORDS 2
+
+/* a reference in a record: 0 for nil, an immediate number as it is, else the object's number << 2 | 1 */
+typedef uint64_t p_Ref;
+
+static uint64_t p_layout(void) {
+    return (uint64_t)((uintptr_t)Fl_image_load - (uintptr_t)Fl_open);
+}
+
+/*
+ * Saving
+ */
+
+typedef struct {
+    Fl_Context *ctx;
+    bool bindings; /* write the values of symbols too */
+    Fl_Object **objs; /* by number, those whose record is still to be written at the end */
+    size_t nobjs, capobjs;
+    size_t *index; /* open addressing from object to its number + 1, 0 for an empty slot */
+    size_t capindex;
+    uint64_t *offsets;
+    uint64_t *buf; /* the records */
+    size_t len, cap;
+} p_Writer;
+
+static void p_writer_free(p_Writer *w) {
+    free(w->objs);
+    free(w->index);
+    free(w->offsets);
+    free(w->buf);
+}
+
+static void p_fail(p_Writer *w, const char *message) {
+    p_writer_free(w);
+    Fl_error(w->ctx, message);
+}
+
+static size_t p_slot(p_Writer *w, Fl_Object *obj) {
+    size_t mask = w->capindex - 1, i = ((uintptr_t)obj >> 4) * 0x9e3779b97f4a7c15ull & mask;
+    while (w->index[i] && w->objs[w->index[i] - 1] != obj)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void p_grow_index(p_Writer *w) {
+    size_t cap = w->capindex ? w->capindex * 2 : 1024;
+    size_t *index = calloc(cap, sizeof(*index)), *old = w->index, oldcap = w->capindex;
+    if (!index)
+        p_fail(w, "I'm out of memory :(");
+    w->index = index;
+    w->capindex = cap;
+    for (size_t i = 0; i < oldcap; ++i)
+        if (old[i])
+            w->index[p_slot(w, w->objs[old[i] - 1])] = old[i];
+    free(old);
+}
+
+/* reference to `obj`, which gets a number and is queued to be written if it hasn't yet */
+static p_Ref p_ref(p_Writer *w, Fl_Object *obj) {
+    if (M_isnil(obj))
+        return 0;
+    if (M_isimm(obj))
+        return (uintptr_t)obj;
+    if ((w->nobjs + 1) * 2 > w->capindex)
+        p_grow_index(w);
+    size_t slot = p_slot(w, obj);
+    if (!w->index[slot]) {
+        if (M_type(obj) == T_PTR || M_type(obj) == T_FREE)
+            p_fail(w, "pointer objects can't leave their context");
+        if (w->nobjs == w->capobjs) {
+            size_t cap = w->capobjs ? w->capobjs * 2 : 1024;
+            Fl_Object **objs = realloc(w->objs, cap * sizeof(*objs));
+            uint64_t *offsets = realloc(w->offsets, cap * sizeof(*offsets));
+            if (objs)
+                w->objs = objs;
+            if (offsets)
+                w->offsets = offsets;
+            if (!objs || !offsets)
+                p_fail(w, "I'm out of memory :(");
+            w->capobjs = cap;
+        }
+        w->objs[w->nobjs++] = obj;
+        w->index[slot] = w->nobjs;
+    }
+    return (uint64_t)(w->index[slot] - 1) << 2 | 1;
+}
+
+static void p_put(p_Writer *w, uint64_t word) {
+    if (w->len == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        uint64_t *buf = realloc(w->buf, cap * sizeof(*buf));
+        if (!buf)
+            p_fail(w, "I'm out of memory :(");
+        w->buf = buf;
+        w->cap = cap;
+    }
+    w->buf[w->len++] = word;
+}
+
+/* `len` and then `len` bytes, padded to whole words */
+static void p_put_bytes(p_Writer *w, const char *s, size_t len) {
+    p_put(w, len);
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, s + i, len - i < sizeof(word) ? len - i : sizeof(word));
+        p_put(w, word);
+    }
+}
+
+static void p_put_code(p_Writer *w, Fl_Code *c) {
+    /* code that isn't compiled yet (or failed to) is compiled from scratch when it's first run */
+    int nops = c->ready ? c->nops : 0, nconsts = c->ready ? c->nconsts : 0, ndecls = c->ready ? c->ndecls : 0;
+    p_put(w, nops);
+    p_put(w, nconsts);
+    p_put(w, ndecls);
+    /* only how many call sites have a cache, what they hold is only good in this context */
+    p_put(w, c->ready ? c->ncaches : 0);
+    p_put(w, c->maxstack);
+    p_put(w, c->expr);
+    p_put(w, c->ready);
+    p_put(w, c->nparams);
+    p_put(w, c->rest);
+    p_put(w, c->nslots);
+    p_put(w, (int64_t)c->parent_decl);
+    p_put(w, (int64_t)c->parent_level);
+    p_put(w, p_ref(w, c->params));
+    p_put(w, c->ready ? 0 : p_ref(w, c->body)); /* compiled code has no more use for its source */
+    p_put(w, p_ref(w, c->parent));
+    for (int i = 0; i < nops; ++i)
+        p_put(w, (int64_t)c->ops[i]);
+    for (int i = 0; i < nconsts; ++i)
+        p_put(w, p_ref(w, c->consts[i]));
+    for (int i = 0; i < ndecls; ++i) {
+        p_put(w, p_ref(w, c->decls[i].sym));
+        p_put(w, (int64_t)c->decls[i].slot);
+        p_put(w, (int64_t)c->decls[i].level);
+        p_put(w, (int64_t)c->decls[i].prev);
+    }
+}
+
+static void p_put_record(p_Writer *w, Fl_Object *obj) {
+    Fl_Type type = M_type(obj);
+    p_put(w, type);
+    switch (type) {
+    case T_PAIR:
+        p_put(w, p_ref(w, M_first(obj)));
+        p_put(w, p_ref(w, M_rest(obj)));
+        break;
+    case T_FUNC:
+    case T_MACRO:
+        p_put(w, p_ref(w, M_rest(obj)));
+        break;
+    case T_NUMBER: {
+        Fl_Number n = M_number(obj);
+        uint64_t word;
+        memcpy(&word, &n, sizeof(word));
+        p_put(w, word);
+        break;
+    }
+    case T_SYMBOL: {
+        /* symbols are interned again by name, the cells behind them aren't saved */
+        Fl_String *name = M_string(M_first(M_rest(obj)));
+        p_put_bytes(w, name->data, name->len);
+        p_put(w, w->bindings ? p_ref(w, M_rest(M_rest(obj))) : 0);
+        break;
+    }
+    case T_STRING:
+        p_put_bytes(w, M_string(obj)->data, M_string(obj)->len);
+        break;
+    case T_BUILTIN:
+        p_put(w, M_builtin(obj));
+        break;
+    case T_CFUNC:
+        p_put(w, (uint64_t)((uintptr_t)M_cfunc(obj) - (uintptr_t)Fl_open));
+        break;
+    case T_CODE:
+        p_put_code(w, M_code(obj));
+        break;
+    case T_FRAME:
+        p_put(w, M_frame(obj)->n);
+        p_put(w, p_ref(w, M_frame(obj)->parent));
+        for (int i = 0; i < M_frame(obj)->n; ++i)
+            p_put(w, p_ref(w, M_frame(obj)->slots[i]));
+        break;
+    case T_VECTOR:
+        p_put(w, M_vector(obj)->len);
+        for (size_t i = 0; i < M_vector(obj)->len; ++i)
+            p_put(w, p_ref(w, M_vector(obj)->items[i]));
+        break;
+    case T_MAP: {
+        Fl_Object *key, *value;
+        p_put(w, Fl_Map_len(obj));
+        for (size_t i = 0; Fl_Map_next(obj, &i, &key, &value);) {
+            p_put(w, p_ref(w, key));
+            p_put(w, p_ref(w, value));
+        }
+        break;
+    }
+    default:
+        p_fail(w, "can't save this object in an image");
+    }
+}
+
+/* records queue the objects they refer to, so this goes on until nothing new turns up */
+static void p_put_records(p_Writer *w) {
+    for (size_t i = 0; i < w->nobjs; ++i) {
+        w->offsets[i] = w->len;
+        p_put_record(w, w->objs[i]);
+    }
+}
+
+/* write every bound symbol and what it reaches to `path` */
+void Fl_image_save(Fl_Context *ctx, const char *path) {
+    p_Writer w = { .ctx = ctx, .bindings = true };
+    Fl_Symtab *tab = &ctx->symtab;
+    for (int i = 0; i < tab->cap; ++i) {
+        Fl_Object *sym = tab->syms[i];
+        if (sym && !M_isnil(sym) && !M_isnil(M_rest(M_rest(sym))))
+            p_ref(&w, sym);
+    }
+    p_put_records(&w);
+
+    p_Header h = { .layout = p_layout(), .cell_size = sizeof(Fl_Object), .nobjects = w.nobjs };
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    strncpy(h.build, IMAGE_BUILD, sizeof(h.build) - 1);
+    h.size = sizeof(h) + (w.nobjs + w.len) * sizeof(uint64_t);
+    FILE *fp = fopen(path, "wb");
+    bool ok = fp && fwrite(&h, sizeof(h), 1, fp) == 1
+        && fwrite(w.offsets, sizeof(*w.offsets), w.nobjs, fp) == w.nobjs
+        && fwrite(w.buf, sizeof(*w.buf), w.len, fp) == w.len;
+    if (fp && fclose(fp))
+        ok = false;
+    if (!ok)
+        p_fail(&w, "could not write the image");
+    p_writer_free(&w);
+}
+
+/* `obj` and what it reaches in a malloc'd block of `*size` bytes, for Fl_image_unpack; symbols
+   bring their global values along if `bindings` is set */
+void *Fl_image_pack(Fl_Context *ctx, Fl_Object *obj, bool bindings, size_t *size) {
+    p_Writer w = { .ctx = ctx, .bindings = bindings };
+    p_Ref root = p_ref(&w, obj);
+    p_put_records(&w);
+
+    *size = (PACK_WORDS + w.nobjs + w.len) * sizeof(uint64_t);
+    uint64_t *pack = malloc(*size);
+    if (!pack)
+        p_fail(&w, "I'm out of memory :(");
+    pack[0] = root;
+    pack[1] = w.nobjs;
+    if (w.nobjs)
+        memcpy(pack + PACK_WORDS, w.offsets, w.nobjs * sizeof(uint64_t));
+    if (w.len)
+        memcpy(pack + PACK_WORDS + w.nobjs, w.buf, w.len * sizeof(uint64_t));
+    p_writer_free(&w);
+    return pack;
+}
+
+/*
+ * Loading
+ */
+
+typedef struct {
+    Fl_Context *ctx;
+    void *map;
+    size_t map_len;
+    const uint64_t *offsets, *records, *pos, *end;
+    uint64_t nobjects;
+    Fl_Object **objs;
+    bool bindings; /* give symbols the values saved with them */
+} p_Loader;
+
+static void p_corrupt(p_Loader *l) {
+    if (l->map)
+        munmap(l->map, l->map_len);
+    Fl_error(l->ctx, "image is corrupt");
+}
+
+static uint64_t p_get(p_Loader *l) {
+    if (l->pos >= l->end)
+        p_corrupt(l);
+    return *l->pos++;
+}
+
+static Fl_Object *p_obj(p_Loader *l) {
+    p_Ref ref = p_get(l);
+    if (!ref)
+        return &nil;
+    if ((ref & 3) == 2 && FL_IMMEDIATES)
+        return (Fl_Object *)(uintptr_t)ref;
+    if ((ref & 3) != 1 || ref >> 2 >= l->nobjects)
+        p_corrupt(l);
+    return l->objs[ref >> 2];
+}
+
+/* bytes saved by p_put_bytes, right in the mapping */
+static const char *p_get_bytes(p_Loader *l, size_t *len) {
+    *len = p_get(l);
+    const char *s = (const char *)l->pos;
+    size_t words = (*len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (words > (size_t)(l->end - l->pos))
+        p_corrupt(l);
+    l->pos += words;
+    return s;
+}
+
+static Fl_Type p_seek(p_Loader *l, size_t i) {
+    if (l->offsets[i] >= (size_t)(l->end - l->records))
+        p_corrupt(l);
+    l->pos = l->records + l->offsets[i];
+    return p_get(l);
+}
+
+/* an object of record `i`'s type, with its contents where they don't refer to other objects */
+static Fl_Object *p_make(p_Loader *l, size_t i) {
+    Fl_Context *ctx = l->ctx;
+    Fl_Object *obj;
+    const char *s;
+    size_t len;
+
+    switch (p_seek(l, i)) {
+    case T_PAIR:
+        return Fl_T_cons(ctx, &nil, &nil);
+    case T_FUNC:
+    case T_MACRO:
+        obj = Fl_object(ctx);
+        M_settype(obj, l->pos[-1]);
+        M_rest(obj) = &nil;
+        return obj;
+    case T_NUMBER: {
+        uint64_t word = p_get(l);
+        Fl_Number n;
+        memcpy(&n, &word, sizeof(n));
+        return Fl_T_number(ctx, n);
+    }
+    case T_SYMBOL:
+        s = p_get_bytes(l, &len);
+        return Fl_Symtab_intern(ctx, s, len);
+    case T_STRING:
+        s = p_get_bytes(l, &len);
+        return Fl_str_make(ctx, s, len);
+    case T_BUILTIN: {
+        uint64_t id = p_get(l);
+        if (id >= BI_LEN)
+            p_corrupt(l);
+        obj = Fl_object(ctx);
+        M_settype(obj, T_BUILTIN);
+        M_builtin(obj) = id;
+        return obj;
+    }
+    case T_CFUNC:
+        return Fl_T_cfunc(ctx, (Fl_CFunc)((uintptr_t)Fl_open + p_get(l)));
+    case T_CODE:
+        return Fl_Code_make(ctx, &nil, &nil);
+    case T_FRAME: {
+        uint64_t n = p_get(l);
+        if (n > (uint64_t)(l->end - l->pos))
+            p_corrupt(l);
+        obj = Fl_object(ctx);
+        M_settype(obj, T_FRAME);
+        M_rest(obj) = NULL; /* in case malloc fails */
+        Fl_Frame *f = malloc(sizeof(Fl_Frame) + n * sizeof(*f->slots));
+        if (!f)
+            Fl_error(ctx, "I'm out of memory :(");
+        f->parent = &nil;
+        f->n = n;
+        for (uint64_t j = 0; j < n; ++j)
+            f->slots[j] = &nil;
+        M_rest(obj) = (Fl_Object *)f;
+        return obj;
+    }
+    case T_VECTOR:
+        return Fl_T_vector(ctx, NULL, 0);
+    case T_MAP:
+        return Fl_Map_make(ctx);
+    default:
+        p_corrupt(l);
+        return NULL;
+    }
+}
+
+static int p_get_int(p_Loader *l) {
+    return (int)(int64_t)p_get(l);
+}
+
+/* a count of at most `per` words each that the rest of the record has room for */
+static int p_get_count(p_Loader *l, size_t per) {
+    uint64_t n = p_get(l);
+    if (n > (uint64_t)(l->end - l->pos) / per)
+        p_corrupt(l);
+    return (int)n;
+}
+
+static void *p_array(p_Loader *l, int n, size_t size) {
+    void *array = n ? malloc(n * size) : NULL;
+    if (n && !array)
+        Fl_error(l->ctx, "I'm out of memory :(");
+    return array;
+}
+
+static void p_fill_code(p_Loader *l, Fl_Code *c) {
+    c->nops = c->capops = p_get_count(l, 1);
+    c->nconsts = c->capconsts = p_get_count(l, 1);
+    c->ndecls = c->capdecls = p_get_count(l, 4);
+    /* each of them has its index among the ops */
+    if ((c->ncaches = c->capcaches = p_get_count(l, 1)) > c->nops)
+        p_corrupt(l);
+    c->maxstack = p_get_int(l);
+    c->expr = p_get(l);
+    c->ready = p_get(l);
+    c->nparams = p_get_int(l);
+    c->rest = p_get(l);
+    c->nslots = p_get_int(l);
+    c->parent_decl = p_get_int(l);
+    c->parent_level = p_get_int(l);
+    c->params = p_obj(l);
+    c->body = p_obj(l);
+    c->parent = p_obj(l);
+    c->ops = p_array(l, c->nops, sizeof(*c->ops));
+    c->consts = p_array(l, c->nconsts, sizeof(*c->consts));
+    c->decls = p_array(l, c->ndecls, sizeof(*c->decls));
+    if (c->ncaches && !(c->caches = calloc(c->ncaches, sizeof(*c->caches))))
+        Fl_error(l->ctx, "I'm out of memory :(");
+    for (int i = 0; i < c->nops; ++i)
+        c->ops[i] = p_get_int(l);
+    for (int i = 0; i < c->nconsts; ++i)
+        c->consts[i] = p_obj(l);
+    for (int i = 0; i < c->ndecls; ++i) {
+        c->decls[i].sym = p_obj(l);
+        c->decls[i].slot = p_get_int(l);
+        c->decls[i].level = p_get_int(l);
+        c->decls[i].prev = p_get_int(l);
+    }
+}
+
+/* fill in the references of record `i` */
+static void p_fill(p_Loader *l, size_t i) {
+    Fl_Context *ctx = l->ctx;
+    Fl_Object *obj = l->objs[i];
+    size_t len;
+
+    switch (p_seek(l, i)) {
+    case T_PAIR:
+        M_first(obj) = p_obj(l);
+        M_rest(obj) = p_obj(l);
+        break;
+    case T_FUNC:
+    case T_MACRO:
+        M_rest(obj) = p_obj(l);
+        break;
+    case T_SYMBOL:
+        p_get_bytes(l, &len);
+        if (l->bindings)
+            Fl_set(ctx, obj, p_obj(l));
+        return;
+    case T_CODE:
+        p_fill_code(l, M_code(obj));
+        break;
+    case T_FRAME:
+        p_get(l);
+        M_frame(obj)->parent = p_obj(l);
+        for (int j = 0; j < M_frame(obj)->n; ++j)
+            M_frame(obj)->slots[j] = p_obj(l);
+        break;
+    case T_VECTOR:
+        for (int n = p_get_count(l, 1); n--;)
+            Fl_vec_push(ctx, obj, p_obj(l));
+        break;
+    case T_MAP:
+        for (int n = p_get_count(l, 2); n--;) {
+            Fl_Object *key = p_obj(l);
+            Fl_Map_set(ctx, obj, key, p_obj(l));
+        }
+        break;
+    default:
+        return;
+    }
+    /* the object may have been promoted by a collection since it was made */
+    Fl_Gc_barrier(ctx, obj);
+}
+
+/* every object is made first and kept in a vector, then they're linked up; `l->objs` holds them
+   until the caller restores the gcstack */
+static void p_load_all(p_Loader *l) {
+    Fl_Context *ctx = l->ctx;
+    Fl_Object *all = Fl_T_vector(ctx, NULL, 0);
+    int keep = Fl_Gc_save(ctx);
+    for (size_t i = 0; i < l->nobjects; ++i) {
+        Fl_vec_push(ctx, all, p_make(l, i));
+        Fl_Gc_restore(ctx, keep);
+    }
+    l->objs = M_vector(all)->items;
+    for (size_t i = 0; i < l->nobjects; ++i)
+        p_fill(l, i);
+}
+
+/* bind the globals saved in the image at `path`, false if it can't be read or is from another build */
+bool Fl_image_load(Fl_Context *ctx, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(p_Header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const p_Header *h = map;
+    if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) || strncmp(h->build, IMAGE_BUILD, sizeof(h->build))
+        || h->layout != p_layout() || h->cell_size != sizeof(Fl_Object) || h->size != (uint64_t)st.st_size
+        || h->nobjects > (h->size - sizeof(*h)) / sizeof(uint64_t)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    p_Loader l = { .ctx = ctx, .map = map, .map_len = st.st_size, .bindings = true };
+    l.nobjects = h->nobjects;
+    l.offsets = (const uint64_t *)(h + 1);
+    l.records = l.offsets + l.nobjects;
+    l.end = (const uint64_t *)((const char *)map + st.st_size);
+
+    int gc = Fl_Gc_save(ctx);
+    p_load_all(&l);
+    Fl_Gc_restore(ctx, gc);
+    munmap(map, st.st_size);
+    return true;
+}
+
+/* a copy of the object packed by Fl_image_pack, made in `ctx` */
+Fl_Object *Fl_image_unpack(Fl_Context *ctx, const void *pack, size_t size, bool bindings) {
+    const uint64_t *words = pack;
+    p_Loader l = { .ctx = ctx, .bindings = bindings };
+    l.nobjects = words[1];
+    l.offsets = words + PACK_WORDS;
+    l.records = l.offsets + l.nobjects;
+    l.end = (const uint64_t *)((const char *)pack + size);
+
+    int gc = Fl_Gc_save(ctx);
+    p_load_all(&l);
+    l.pos = words;
+    Fl_Object *root = p_obj(&l);
+    Fl_Gc_restore(ctx, gc);
+    Fl_Gc_push(ctx, root);
+    return root;
+}
@@ -1,30 +1,75 @@
 #include <string.h>
-#include <setjmp.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "lib.h"
 #include "util.h"
 #include "config.h"
 #include "flamingo.h"
+#include "image.h"
+#include "prof.h"
 
-static jmp_buf global_execution_context;
-static char buf[1024 * 64];
+#define FL_HEAP_ENV "FLAMINGO_HEAP" /* heap size limit, like `-m` */
+
+static bool p_gc_summary;
+
+typedef struct {
+    Fl_Reader in;
+    bool print; /* write the value of each expression */
+    bool done;
+} p_Session;
 
 __attribute__((noreturn)) static void p_print_help(int exit_status, char **av) {
     printf("%s\n"
-    "Usage: %s [-hv] [-s string] [file ...]\n"
+    "Usage: %s [-dghv] [-i image] [-o image] [-m size] [-P file] [-s string] [file ...]\n"
     "Options:\n"
     "  -s str   execute string 'str'\n"
+    "  -i img   start from heap image 'img' instead of loading the library (--image)\n"
+    "  -o img   save the heap after loading the library to image 'img' and exit (--save-image)\n"
+    "  -d       dump the compiled code of each expression to stderr\n"
+    "  -m size  limit the heap to 'size' bytes, e.g. 512k, 64m or 2g (or set " FL_HEAP_ENV ")\n"
+    "  -P file  profile, write folded stacks (for flame graphs) to 'file' and a summary to stderr (--profile)\n"
+    "  -g       write a line about the garbage collector's work to stderr on exit (--gc-stats)\n"
     "  -h       print help (this text) and exit\n"
     "  -v       print version information and exit\n", FL_HELP_HEADER, *av);
     exit(exit_status);
 }
 
-static void p_error(Fl_Context *ctx, const char *message, Fl_Object *call_list) {
-    M_unused(ctx);
+static void p_print_gc_summary(Fl_Context *ctx) {
+    Fl_Gc_Stats st;
+    size_t allocated = 0;
+    Fl_Gc_stats(ctx, &st);
+    for (int t = 0; t < FL_NTYPES; ++t)
+        allocated += st.allocated[t];
+    fprintf(stderr, "[gc] %lu minor + %lu full collections, %.3f ms paused (max %.3f ms), %zu cells allocated, "
+        "%zu in use (max %zu) of %zu, gcstack max %d\n", st.collections[0], st.collections[1],
+        st.pause_total * 1e3, st.pause_max * 1e3, allocated, st.in_use, st.in_use_max, st.cells, st.gcstack_max);
+}
+
+/* the program is about to exit on an error, keep the profile and the gc summary so far */
+static void p_exit_error(Fl_Context *ctx, const char *message, Fl_Object *call_list) {
+    M_unused(message);
     M_unused(call_list);
-    fprintf(stderr, "[error] %s\n", message);
-    longjmp(global_execution_context, -1);
+    if (ctx->recover)
+        return;
+    Fl_Prof_stop(ctx);
+    if (p_gc_summary)
+        p_print_gc_summary(ctx);
+}
+
+/* read, run and maybe print one expression */
+static void p_step(Fl_Context *ctx, void *data) {
+    p_Session *s = data;
+    Fl_Object *obj = Fl_read_from(ctx, &s->in);
+    if (!obj) {
+        s->done = true;
+        return;
+    }
+    obj = Fl_exec(ctx, Fl_optimize(ctx, obj));
+    if (s->print) {
+        Fl_writefp(ctx, obj, stdout);
+        putchar('\n');
+    }
 }
 
 static void p_load(Fl_Context *ctx, const char *fn) {
@@ -50,61 +95,117 @@ static void p_load(Fl_Context *ctx, const char *fn) {
 }
 
 int main(int argc, char **argv) {
-    Fl_Object *obj;
-    FILE *volatile fp = stdin;
-    Fl_Context *ctx = Fl_open(buf, sizeof(buf));
-    char *exec_str = NULL;
+    FILE *fp = stdin;
+    Fl_Context *ctx;
+    p_Session session = { .done = false };
+    char *exec_str = NULL, *heap_str = getenv(FL_HEAP_ENV), *image = NULL, *save_image = NULL;
+    FILE *prof = NULL;
+    size_t heap_size = 0; /* no limit */
+    bool dump = false;
     int c;
+    static const struct option long_options[] = {
+        { "image", required_argument, NULL, 'i' },
+        { "save-image", required_argument, NULL, 'o' },
+        { "profile", required_argument, NULL, 'P' },
+        { "gc-stats", no_argument, NULL, 'g' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    p_load(ctx, "base.fl");
-    bs_register_all(ctx);
-
-    while ((c = getopt(argc, argv, "vhs:")) != -1) {
+    while ((c = getopt_long(argc, argv, "vhdgm:s:i:o:P:", long_options, NULL)) != -1) {
         switch (c) {
+        case 'd':
+            dump = true;
+            break;
+        case 'g':
+            p_gc_summary = true;
+            break;
         case 'v':
             printf("%s %s\nCopyright (C) 2020 Tomer Shechner\n", FL_PROGRAM_NAME, FL_VERSION);
             return EXIT_SUCCESS;
         case 'h':
             p_print_help(EXIT_SUCCESS, argv);
             break;
+        case 'm':
+            heap_str = optarg;
+            break;
         case 's':
             exec_str = optarg;
             break;
+        case 'i':
+            image = optarg;
+            break;
+        case 'o':
+            save_image = optarg;
+            break;
+        case 'P':
+            if (!(prof = fopen(optarg, "w"))) {
+                fprintf(stderr, "could not open '%s' for the profile\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         default:
             p_print_help(EXIT_FAILURE, argv);
         }
     }
 
+    if (heap_str && !parse_size(heap_str, &heap_size)) {
+        fprintf(stderr, "invalid heap size '%s'\n", heap_str);
+        return EXIT_FAILURE;
+    }
+    if (!(ctx = Fl_open(heap_size))) {
+        fputs("could not allocate the interpreter\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if (!image || !Fl_image_load(ctx, image)) {
+        if (image)
+            fprintf(stderr, "image '%s' can't be used (missing, or made by another build), loading the library instead\n", image);
+        p_load(ctx, "base.fl");
+        bs_register_all(ctx);
+    }
+    if (save_image) {
+        Fl_image_save(ctx, save_image);
+        return EXIT_SUCCESS;
+    }
+    if (dump)
+        ctx->dump = stderr;
+    if (prof || p_gc_summary)
+        Fl_handlers(ctx)->error = p_exit_error;
+    if (prof)
+        Fl_Prof_start(ctx, prof, 0);
+
     if (exec_str) {
-        if (!(fp = tmpfile())) {
-            fprintf(stderr, "unexpected error, could not execute given string '%s'\n", exec_str);
-            return EXIT_FAILURE;
-        }
-        fputs(exec_str, fp);
-    } else if (argc > 1 && !(fp = fopen(argv[1], "r"))) {
+        fp = NULL;
+        Fl_reader_buf(&session.in, exec_str, strlen(exec_str));
+    } else if (optind < argc && !(fp = fopen(argv[optind], "r"))) {
         Fl_error(ctx, "could not open file");
+    } else {
+        Fl_reader_file(&session.in, fp);
     }
+    session.print = exec_str || fp == stdin;
 
-    if (fp == stdin) {
-        Fl_handlers(ctx)->error = p_error;
+    if (fp == stdin)
         printf("%s %s on %s\n", FL_PROGRAM_NAME, FL_VERSION, os_name());
-    }
 
-    int gci = Fl_Gc_save(ctx); /* gc stack index */
-    setjmp(global_execution_context);
-
-    while (true) {
-        if (fp == stdin)
+    int scope = Fl_scope_open(ctx);
+    while (!session.done) {
+        if (fp != stdin) {
+            /* errors end the program, with a traceback */
+            p_step(ctx, &session);
+        } else {
             fputs("=> ", stdout);
-        if (!(obj = Fl_readfp(ctx, fp)))
-            break;
-        obj = Fl_eval(ctx, obj);
-        if (exec_str || fp == stdin) {
-            Fl_writefp(ctx, obj, stdout);
-            putchar('\n');
+            if (!Fl_protect(ctx, p_step, &session))
+                fprintf(stderr, "[error] %s\n", ctx->error);
         }
-        Fl_Gc_restore(ctx, gci);
+        Fl_scope_close(ctx, scope, NULL);
+    }
+    Fl_reader_close(&session.in);
+    if (prof) {
+        Fl_Prof_stop(ctx);
+        fclose(prof);
     }
-    fclose(fp);
+    if (fp)
+        fclose(fp);
+    if (p_gc_summary)
+        p_print_gc_summary(ctx);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include "map.h"
+#include "type.h"
+#include "gc.h"
+
+static const Fl_Object p_tomb; /* the key of a deleted slot, never handed out */
+#define tomb (*(Fl_Object *)&p_tomb)
+
+#define M_live(E) ((E)->key && (E)->key != &tomb)
+
+static unsigned p_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+/* numbers hash by value and strings by content, like `=` compares them; anything else is itself */
+static unsigned p_hash(Fl_Object *key) {
+    switch (M_type(key)) {
+    case T_NUMBER: {
+        Fl_Number n = M_number(key);
+        uint64_t bits;
+        if (n == 0)
+            n = 0; /* -0 is the same key as 0 */
+        memcpy(&bits, &n, sizeof(bits));
+        return p_mix(bits);
+    }
+    case T_STRING: {
+        /* FNV-1a, as for symbol names */
+        unsigned h = 2166136261u;
+        const char *s = M_string(key)->data;
+        for (size_t len = M_string(key)->len; len--;) {
+            h ^= (unsigned char)*s++;
+            h *= 16777619u;
+        }
+        return h;
+    }
+    default:
+        return p_mix((uintptr_t)key);
+    }
+}
+
+static bool p_same(Fl_Object *x, Fl_Object *y) {
+    if (x == y)
+        return true;
+    if (M_type(x) != M_type(y))
+        return false;
+    if (M_type(x) == T_NUMBER)
+        return M_number(x) == M_number(y);
+    if (M_type(x) == T_STRING)
+        return M_string(x)->len == M_string(y)->len && !memcmp(M_string(x)->data, M_string(y)->data, M_string(x)->len);
+    return false;
+}
+
+static void p_alloc(Fl_Context *ctx, Fl_Table *tab, size_t cap) {
+    Fl_Entry *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+        Fl_error(ctx, "I'm out of memory :(");
+    tab->slots = slots;
+    tab->cap = cap;
+    tab->count = tab->used = 0;
+    ctx->heap.nursery += cap * sizeof(*slots) / sizeof(Fl_Object);
+}
+
+static Fl_Entry *p_find(Fl_Table *tab, Fl_Object *key, unsigned hash) {
+    if (!tab->slots)
+        return NULL;
+    for (size_t mask = tab->cap - 1, i = hash & mask; tab->slots[i].key; i = (i + 1) & mask) {
+        Fl_Entry *e = &tab->slots[i];
+        if (e->hash == hash && e->key != &tomb && p_same(e->key, key))
+            return e;
+    }
+    return NULL;
+}
+
+/* `key` must not be in the table already */
+static void p_insert(Fl_Table *tab, Fl_Object *key, Fl_Object *value, unsigned hash) {
+    size_t mask = tab->cap - 1, i = hash & mask;
+    while (M_live(&tab->slots[i]))
+        i = (i + 1) & mask;
+    if (!tab->slots[i].key)
+        ++tab->used;
+    tab->slots[i] = (Fl_Entry){ key, value, hash };
+    ++tab->count;
+}
+
+static void p_remove(Fl_Table *tab, Fl_Entry *e) {
+    e->key = &tomb;
+    e->value = NULL;
+    --tab->count;
+}
+
+/* move up to `n` slots of the old table over, dropping it once it's empty */
+static void p_step(Fl_Map *m, size_t n) {
+    if (!m->old.slots)
+        return;
+    for (; n && m->moved < m->old.cap; --n, ++m->moved) {
+        Fl_Entry *e = &m->old.slots[m->moved];
+        if (M_live(e)) {
+            p_insert(&m->cur, e->key, e->value, e->hash);
+            p_remove(&m->old, e);
+        }
+    }
+    if (m->moved == m->old.cap) {
+        free(m->old.slots);
+        memset(&m->old, 0, sizeof(m->old));
+    }
+}
+
+/* make room for one more key; the new table starts half full at most and at least a quarter the
+   size of the old one, so the old one is done moving before the new one needs to grow in turn */
+static void p_reserve(Fl_Context *ctx, Fl_Map *m) {
+    if ((m->cur.used + 1) * 4 <= m->cur.cap * 3)
+        return;
+    p_step(m, SIZE_MAX);
+    size_t count = m->cur.count, cap = MAP_INIT_SIZE;
+    while (cap < (count + 1) * 2 || cap < m->cur.cap / 4)
+        cap *= 2;
+    m->old = m->cur;
+    m->moved = 0;
+    memset(&m->cur, 0, sizeof(m->cur));
+    p_alloc(ctx, &m->cur, cap);
+}
+
+Fl_Object *Fl_Map_make(Fl_Context *ctx) {
+    Fl_Object *obj = Fl_object(ctx);
+    M_settype(obj, T_MAP);
+    M_rest(obj) = NULL; /* in case calloc fails */
+    Fl_Map *m = calloc(1, sizeof(Fl_Map));
+    if (!m)
+        Fl_error(ctx, "I'm out of memory :(");
+    M_rest(obj) = (Fl_Object *)m;
+    p_alloc(ctx, &m->cur, MAP_INIT_SIZE);
+    return obj;
+}
+
+/* value of `key` in `map`, NULL if it has none */
+Fl_Object *Fl_Map_get(Fl_Context *ctx, Fl_Object *map, Fl_Object *key) {
+    M_unused(ctx);
+    Fl_Map *m = M_map(map);
+    unsigned hash = p_hash(key);
+    p_step(m, MAP_STEP);
+    Fl_Entry *e = p_find(&m->cur, key, hash);
+    if (!e)
+        e = p_find(&m->old, key, hash);
+    return e ? e->value : NULL;
+}
+
+void Fl_Map_set(Fl_Context *ctx, Fl_Object *map, Fl_Object *key, Fl_Object *value) {
+    Fl_Map *m = M_map(map);
+    unsigned hash = p_hash(key);
+    p_step(m, MAP_STEP);
+    Fl_Entry *e = p_find(&m->cur, key, hash);
+    if (e) {
+        e->value = value;
+    } else {
+        /* a key still in the old table is moved over with its new value */
+        if ((e = p_find(&m->old, key, hash)))
+            p_remove(&m->old, e);
+        p_reserve(ctx, m);
+        p_insert(&m->cur, key, value, hash);
+    }
+    M_barrier(ctx, map);
+}
+
+bool Fl_Map_del(Fl_Context *ctx, Fl_Object *map, Fl_Object *key) {
+    M_unused(ctx);
+    Fl_Map *m = M_map(map);
+    unsigned hash = p_hash(key);
+    p_step(m, MAP_STEP);
+    Fl_Entry *e = p_find(&m->cur, key, hash);
+    if (e) {
+        p_remove(&m->cur, e);
+        return true;
+    }
+    if ((e = p_find(&m->old, key, hash))) {
+        p_remove(&m->old, e);
+        return true;
+    }
+    return false;
+}
+
+/* the entry at or after `*i`, false when there are no more; start with `*i` at 0 */
+bool Fl_Map_next(Fl_Object *map, size_t *i, Fl_Object **key, Fl_Object **value) {
+    Fl_Map *m = M_map(map);
+    for (; *i < m->cur.cap + m->old.cap; ++*i) {
+        Fl_Entry *e = *i < m->cur.cap ? &m->cur.slots[*i] : &m->old.slots[*i - m->cur.cap];
+        if (M_live(e)) {
+            *key = e->key;
+            *value = e->value;
+            ++*i;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Fl_Map_len(Fl_Object *map) {
+    return M_map(map)->cur.count + M_map(map)->old.count;
+}
+
+void Fl_Map_mark(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Map *m = M_map(obj);
+    if (!m)
+        return;
+    Fl_Table *tabs[] = { &m->cur, &m->old };
+    for (int t = 0; t < 2; ++t) {
+        for (size_t i = 0; i < tabs[t]->cap; ++i) {
+            Fl_Entry *e = &tabs[t]->slots[i];
+            if (M_live(e)) {
+                Fl_Gc_mark(ctx, e->key);
+                Fl_Gc_mark(ctx, e->value);
+            }
+        }
+    }
+}
+
+void Fl_Map_free(Fl_Object *obj) {
+    Fl_Map *m = M_map(obj);
+    if (!m)
+        return;
+    free(m->cur.slots);
+    free(m->old.slots);
+    free(m);
+}
@@ -0,0 +1,200 @@
+/* Worker contexts on threads of their own, running a function over parts of a list in parallel */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "type.h"
+#include "gc.h"
+#include "image.h"
+
+/* results of `fn` on the elements of `list`, nil if they aren't collected */
+static Fl_Object *p_apply(Fl_Context *ctx, Fl_Object *fn, Fl_Object *list, bool collect) {
+    Fl_Object *head = &nil, *last = NULL;
+    int gc = Fl_Gc_save(ctx);
+    for (; !M_isnil(list); list = M_rest(list)) {
+        Fl_Object *item = Fl_first(ctx, list);
+        /* `fn` may cut the list, hold on to the rest of it */
+        Fl_Gc_push(ctx, list);
+        Fl_Object *res = Fl_call(ctx, fn, &item, 1);
+        if (collect) {
+            Fl_Object *cell = Fl_T_cons(ctx, res, &nil);
+            if (last) {
+                M_rest(last) = cell;
+                M_barrier(ctx, last);
+            } else {
+                head = cell;
+            }
+            last = cell;
+        }
+        Fl_Gc_restore(ctx, gc);
+        Fl_Gc_push(ctx, head);
+    }
+    return head;
+}
+
+/* what a worker does with its part: copy it in, run it, and copy the results out */
+static void p_job(Fl_Context *ctx, void *data) {
+    Fl_Worker *w = data;
+    int gc = Fl_Gc_save(ctx);
+    Fl_Object *job = Fl_image_unpack(ctx, w->in, w->in_size, true);
+    Fl_Object *res = p_apply(ctx, M_first(job), M_rest(job), w->collect);
+    w->out = Fl_image_pack(ctx, res, false, &w->out_size);
+    Fl_Gc_restore(ctx, gc);
+}
+
+static void *p_work(void *data) {
+    Fl_Worker *w = data;
+    Fl_Pool *pool = w->pool;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (w->round == pool->round && !pool->quit)
+            pthread_cond_wait(&pool->go, &pool->lock);
+        if (pool->quit)
+            break;
+        w->round = pool->round;
+        if (w->index >= pool->active)
+            continue;
+        pthread_mutex_unlock(&pool->lock);
+        if ((w->failed = !Fl_protect(w->ctx, p_job, w)))
+            snprintf(w->error, sizeof(w->error), "%s", w->ctx->error);
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->pending)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* the pool of `ctx` with `n` workers at least */
+static Fl_Pool *p_start(Fl_Context *ctx, int n) {
+    Fl_Pool *pool = ctx->pool;
+    if (!pool) {
+        if (!(pool = calloc(1, sizeof(*pool))))
+            Fl_error(ctx, "I'm out of memory :(");
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->go, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        ctx->pool = pool;
+    }
+    /* workers get the caller's heap limit, each */
+    size_t heap_size = ctx->heap.limit == (size_t)-1 ? 0 : ctx->heap.limit * GC_SEGMENT_SIZE;
+    while (pool->n < n) {
+        Fl_Worker *w = &pool->workers[pool->n];
+        w->pool = pool;
+        w->index = pool->n;
+        w->round = pool->round;
+        if (!(w->ctx = Fl_open(heap_size)))
+            Fl_error(ctx, "I'm out of memory :(");
+        if (pthread_create(&w->thread, NULL, p_work, w)) {
+            Fl_close(w->ctx);
+            Fl_error(ctx, "could not start a worker thread");
+        }
+        ++pool->n;
+    }
+    return pool;
+}
+
+/* free what the last round left behind */
+static void p_drop(Fl_Pool *pool) {
+    for (int i = 0; i < pool->n; ++i) {
+        Fl_Worker *w = &pool->workers[i];
+        free(w->in);
+        free(w->out);
+        w->in = w->out = NULL;
+    }
+}
+
+static void p_raise(Fl_Context *ctx, Fl_Pool *pool, const char *message) {
+    char buf[sizeof(ctx->error)];
+    snprintf(buf, sizeof(buf), "%s", message);
+    p_drop(pool);
+    Fl_error(ctx, buf);
+}
+
+/*
+ * `fn` on every element of `list`, which is split into `threads` parts (as many as there are
+ * processors for 0) for as many workers. They work on copies of `fn` and their part, so they see the
+ * globals these refer to as they are now, and what they change stays with them. The results are
+ * copied back in order, the list of them is returned if `collect` is set and nil otherwise. An error
+ * in any part is raised once all are done
+ */
+Fl_Object *Fl_Pool_map(Fl_Context *ctx, Fl_Object *fn, Fl_Object *list, int threads, bool collect) {
+    size_t len = 0;
+    for (Fl_Object *l = list; !M_isnil(l); l = M_rest(l), ++len)
+        Fl_check_type(ctx, l, T_PAIR);
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > POOL_MAX_WORKERS)
+        threads = POOL_MAX_WORKERS;
+    if ((size_t)threads > len)
+        threads = (int)len;
+    if (!threads)
+        return &nil;
+
+    Fl_Pool *pool = p_start(ctx, threads);
+    p_drop(pool);
+    Fl_Object *l = list;
+    int gc = Fl_Gc_save(ctx);
+    for (int i = 0; i < threads; ++i) {
+        Fl_Worker *w = &pool->workers[i];
+        Fl_Object *job = Fl_T_cons(ctx, fn, &nil), *last = job;
+        for (size_t n = len / threads + ((size_t)i < len % threads); n--; l = M_rest(l)) {
+            M_rest(last) = Fl_T_cons(ctx, M_first(l), &nil);
+            M_barrier(ctx, last);
+            last = M_rest(last);
+        }
+        w->in = Fl_image_pack(ctx, job, true, &w->in_size);
+        w->collect = collect;
+        Fl_Gc_restore(ctx, gc);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->active = pool->pending = threads;
+    ++pool->round;
+    pthread_cond_broadcast(&pool->go);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < threads; ++i) {
+        if (pool->workers[i].failed)
+            p_raise(ctx, pool, pool->workers[i].error);
+    }
+    Fl_Object *head = &nil, *last = NULL;
+    for (int i = 0; collect && i < threads; ++i) {
+        Fl_Worker *w = &pool->workers[i];
+        Fl_Object *part = Fl_image_unpack(ctx, w->out, w->out_size, false);
+        if (last)
+            M_rest(last) = part;
+        else
+            head = last = part;
+        M_barrier(ctx, last);
+        while (!M_isnil(M_rest(last)))
+            last = M_rest(last);
+        Fl_Gc_restore(ctx, gc);
+        Fl_Gc_push(ctx, head);
+    }
+    p_drop(pool);
+    return head;
+}
+
+void Fl_Pool_free(Fl_Context *ctx) {
+    Fl_Pool *pool = ctx->pool;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->go);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+        Fl_close(pool->workers[i].ctx);
+    }
+    p_drop(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->go);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+    ctx->pool = NULL;
+}
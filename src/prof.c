@@ -0,0 +1,302 @@
+/*
+ * Sampling profiler: a CPU time timer raises SIGPROF, which only flags the vm; the vm takes the
+ * sample at its next safe point (a call, a loop going around, a C function returning), where the
+ * call sites of the activations are where they should be. Stacks are counted by the call site forms
+ * they're made of and written out as folded stacks, one "outer;...;inner count" line each, which
+ * flame graph tools read
+ */
+
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "prof.h"
+#include "vm.h"
+
+/* the timer and the signal are the process's, so one context at a time can have them */
+static pthread_mutex_t p_lock = PTHREAD_MUTEX_INITIALIZER;
+static Fl_Vm *volatile p_target;
+
+static void p_tick(int sig) {
+    Fl_Vm *vm = p_target;
+    M_unused(sig);
+    if (vm)
+        vm->sample = 1;
+}
+
+static void *p_alloc(Fl_Context *ctx, size_t n, size_t size) {
+    void *mem = calloc(n, size);
+    if (!mem)
+        Fl_error(ctx, "I'm out of memory :(");
+    return mem;
+}
+
+static unsigned p_hash_str(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* number of call site `name`, a new one if it wasn't seen before */
+static unsigned p_intern(Fl_Context *ctx, Fl_Profile *p, const char *name) {
+    if ((p->nnames + 1) * 2 > p->capbyname) {
+        size_t cap = p->capbyname ? p->capbyname * 2 : 256;
+        unsigned *byname = p_alloc(ctx, cap, sizeof(*byname));
+        for (size_t i = 0; i < p->capbyname; ++i) {
+            if (!p->byname[i])
+                continue;
+            size_t j = p_hash_str(p->names[p->byname[i] - 1]) & (cap - 1);
+            while (byname[j])
+                j = (j + 1) & (cap - 1);
+            byname[j] = p->byname[i];
+        }
+        free(p->byname);
+        p->byname = byname;
+        p->capbyname = cap;
+    }
+    size_t mask = p->capbyname - 1, i = p_hash_str(name) & mask;
+    for (; p->byname[i]; i = (i + 1) & mask) {
+        if (!strcmp(p->names[p->byname[i] - 1], name))
+            return p->byname[i] - 1;
+    }
+    if (p->nnames == p->capnames) {
+        size_t cap = p->capnames ? p->capnames * 2 : 128;
+        char **names = realloc(p->names, cap * sizeof(*names));
+        if (!names)
+            Fl_error(ctx, "I'm out of memory :(");
+        p->names = names;
+        p->capnames = cap;
+    }
+    char *copy = p_alloc(ctx, strlen(name) + 1, 1);
+    strcpy(copy, name);
+    p->names[p->nnames++] = copy;
+    p->byname[i] = p->nnames;
+    return p->nnames - 1;
+}
+
+static size_t p_form_slot(Fl_Profile *p, Fl_Object *form) {
+    size_t mask = p->capbyform - 1, i = ((uintptr_t)form >> 4) * 0x9e3779b97f4a7c15ull & mask;
+    while (p->byform[i].form && p->byform[i].form != form)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* number of the call site `form` is, written out once for as long as it's sure to be the same form */
+static unsigned p_site(Fl_Context *ctx, Fl_Profile *p, Fl_Object *form) {
+    if ((p->nbyform + 1) * 2 > p->capbyform) {
+        size_t oldcap = p->capbyform;
+        Fl_Site *old = p->byform;
+        p->capbyform = oldcap ? oldcap * 2 : 1024;
+        p->byform = p_alloc(ctx, p->capbyform, sizeof(*p->byform));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].form)
+                p->byform[p_form_slot(p, old[i].form)] = old[i];
+        free(old);
+    }
+    size_t i = p_form_slot(p, form);
+    if (!p->byform[i].form) {
+        char buf[MAX_BUF_LEN * 2];
+        Fl_to_string(ctx, form, buf, sizeof(buf));
+        /* `;` separates frames in a folded stack and the count follows the last space, keep
+           to one line */
+        for (char *s = buf; *s; ++s) {
+            if (*s == ';')
+                *s = ',';
+            else if ((unsigned char)*s < ' ')
+                *s = ' ';
+        }
+        p->byform[i].form = form;
+        p->byform[i].site = p_intern(ctx, p, buf);
+        ++p->nbyform;
+    }
+    return p->byform[i].site;
+}
+
+static unsigned p_hash_stack(const unsigned *sites, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; ++i)
+        h = (h ^ sites[i]) * 16777619u;
+    return h;
+}
+
+static size_t p_stack_slot(Fl_Profile *p, const unsigned *sites, int n, unsigned hash) {
+    size_t mask = p->capstacks - 1, i = hash & mask;
+    for (; p->stacks[i].sites; i = (i + 1) & mask) {
+        Fl_Stack *s = &p->stacks[i];
+        if (s->hash == hash && s->n == n && !memcmp(s->sites, sites, n * sizeof(*sites)))
+            break;
+    }
+    return i;
+}
+
+static void p_count(Fl_Context *ctx, Fl_Profile *p, const unsigned *sites, int n) {
+    if ((p->nstacks + 1) * 2 > p->capstacks) {
+        size_t oldcap = p->capstacks;
+        Fl_Stack *old = p->stacks;
+        p->capstacks = oldcap ? oldcap * 2 : 256;
+        p->stacks = p_alloc(ctx, p->capstacks, sizeof(*p->stacks));
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].sites)
+                p->stacks[p_stack_slot(p, old[i].sites, old[i].n, old[i].hash)] = old[i];
+        free(old);
+    }
+    unsigned hash = p_hash_stack(sites, n);
+    Fl_Stack *s = &p->stacks[p_stack_slot(p, sites, n, hash)];
+    if (!s->sites) {
+        s->sites = p_alloc(ctx, n, sizeof(*sites));
+        memcpy(s->sites, sites, n * sizeof(*sites));
+        s->n = n;
+        s->hash = hash;
+        ++p->nstacks;
+    }
+    ++s->count;
+    ++p->samples;
+}
+
+/* count the call sites of the `depth` outermost activations; the vm calls this when flagged */
+void Fl_Prof_sample(Fl_Context *ctx, int depth) {
+    Fl_Profile *p = ctx->prof;
+    Fl_Vm *vm = ctx->vm;
+    unsigned sites[PROF_MAX_DEPTH];
+    int n = 0;
+
+    vm->sample = 0;
+    if (!p)
+        return;
+    /* a form's cell may have been freed and reused by now */
+    unsigned long collections = ctx->heap.collections[0] + ctx->heap.collections[1];
+    if (collections != p->collections && p->byform) {
+        memset(p->byform, 0, p->capbyform * sizeof(*p->byform));
+        p->nbyform = 0;
+        p->collections = collections;
+    }
+    for (int i = depth > PROF_MAX_DEPTH ? depth - PROF_MAX_DEPTH : 0; i < depth; ++i) {
+        Fl_Activation *fr = &vm->frames[i];
+        Fl_Code *c = M_code(fr->code);
+        if (fr->pc)
+            sites[n++] = p_site(ctx, p, c->consts[c->ops[fr->pc - 1]]);
+    }
+    /* top-level code, or what a call from it in tail position replaced it with */
+    if (!n)
+        sites[n++] = p_intern(ctx, p, "(top level)");
+    p_count(ctx, p, sites, n);
+}
+
+/* sample `ctx` every `interval_us` microseconds of CPU time (PROF_INTERVAL_US for 0) until
+   Fl_Prof_stop, which writes the stacks to `out` */
+void Fl_Prof_start(Fl_Context *ctx, FILE *out, unsigned interval_us) {
+    if (ctx->prof)
+        Fl_error(ctx, "already profiling");
+    pthread_mutex_lock(&p_lock);
+    if (p_target) {
+        pthread_mutex_unlock(&p_lock);
+        Fl_error(ctx, "another context is being profiled");
+    }
+    Fl_Profile *p = calloc(1, sizeof(*p));
+    if (!p) {
+        pthread_mutex_unlock(&p_lock);
+        Fl_error(ctx, "I'm out of memory :(");
+    }
+    p->out = out;
+    ctx->prof = p;
+    p_target = ctx->vm;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = p_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    if (!interval_us)
+        interval_us = PROF_INTERVAL_US;
+    struct itimerval it = { { interval_us / 1000000, interval_us % 1000000 },
+                            { interval_us / 1000000, interval_us % 1000000 } };
+    setitimer(ITIMER_PROF, &it, NULL);
+    pthread_mutex_unlock(&p_lock);
+}
+
+typedef struct {
+    unsigned site;
+    unsigned long self, total;
+} p_Row;
+
+static int p_by_self(const void *a, const void *b) {
+    const p_Row *x = a, *y = b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+/* the PROF_TOP call sites most samples were taken in (self) and under (total) */
+static void p_report(Fl_Profile *p, FILE *fp) {
+    p_Row *rows = calloc(p->nnames, sizeof(*rows));
+    size_t *seen = calloc(p->nnames, sizeof(*seen));
+    if (p->nnames && (!rows || !seen)) {
+        free(rows);
+        free(seen);
+        return;
+    }
+    for (size_t i = 0; i < p->nnames; ++i)
+        rows[i].site = i;
+    for (size_t i = 0, stamp = 0; i < p->capstacks; ++i) {
+        Fl_Stack *s = &p->stacks[i];
+        if (!s->sites)
+            continue;
+        ++stamp;
+        rows[s->sites[s->n - 1]].self += s->count;
+        /* recursion puts a site on a stack more than once, it counts once */
+        for (int j = 0; j < s->n; ++j) {
+            if (seen[s->sites[j]] != stamp) {
+                seen[s->sites[j]] = stamp;
+                rows[s->sites[j]].total += s->count;
+            }
+        }
+    }
+    qsort(rows, p->nnames, sizeof(*rows), p_by_self);
+    fprintf(fp, "%lu samples\n%7s %7s  %s\n", p->samples, "self", "total", "call site");
+    double all = p->samples ? p->samples : 1;
+    for (size_t i = 0; i < p->nnames && i < PROF_TOP; ++i)
+        fprintf(fp, "%6.2f%% %6.2f%%  %s\n", rows[i].self * 100 / all, rows[i].total * 100 / all,
+            p->names[rows[i].site]);
+    free(rows);
+    free(seen);
+}
+
+/* stop sampling, write the folded stacks to where Fl_Prof_start was told and a summary to stderr */
+void Fl_Prof_stop(Fl_Context *ctx) {
+    Fl_Profile *p = ctx->prof;
+    if (!p)
+        return;
+    pthread_mutex_lock(&p_lock);
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &off, NULL);
+    /* the handler stays, a tick still on its way finds nothing to flag */
+    p_target = NULL;
+    pthread_mutex_unlock(&p_lock);
+    ctx->vm->sample = 0;
+    ctx->prof = NULL;
+
+    for (size_t i = 0; i < p->capstacks; ++i) {
+        Fl_Stack *s = &p->stacks[i];
+        if (!s->sites)
+            continue;
+        for (int j = 0; j < s->n; ++j)
+            fprintf(p->out, "%s%s", j ? ";" : "", p->names[s->sites[j]]);
+        fprintf(p->out, " %lu\n", s->count);
+    }
+    fflush(p->out);
+    p_report(p, stderr);
+    for (size_t i = 0; i < p->capstacks; ++i)
+        free(p->stacks[i].sites);
+    for (size_t i = 0; i < p->nnames; ++i)
+        free(p->names[i]);
+    free(p->names);
+    free(p->byname);
+    free(p->byform);
+    free(p->stacks);
+    free(p);
+}
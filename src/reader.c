@@ -0,0 +1,263 @@
+/* Reader, turns source text into objects */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flamingo.h"
+#include "type.h"
+#include "gc.h"
+#include "symtab.h"
+
+#define C_SPACE  1 /* skipped between tokens */
+#define C_DELIM  2 /* ends a symbol or number */
+#define C_NUMBER 4 /* may start something strtod takes */
+
+static const unsigned char p_class[256] = {
+    ['\0'] = C_DELIM,
+    [' '] = C_SPACE | C_DELIM, ['\n'] = C_SPACE | C_DELIM, ['\t'] = C_SPACE | C_DELIM,
+    ['\r'] = C_SPACE | C_DELIM, ['\v'] = C_SPACE, ['\f'] = C_SPACE,
+    ['('] = C_DELIM, [')'] = C_DELIM, [';'] = C_DELIM,
+    ['0'] = C_NUMBER, ['1'] = C_NUMBER, ['2'] = C_NUMBER, ['3'] = C_NUMBER, ['4'] = C_NUMBER,
+    ['5'] = C_NUMBER, ['6'] = C_NUMBER, ['7'] = C_NUMBER, ['8'] = C_NUMBER, ['9'] = C_NUMBER,
+    ['+'] = C_NUMBER, ['-'] = C_NUMBER, ['.'] = C_NUMBER,
+    ['i'] = C_NUMBER, ['I'] = C_NUMBER, ['n'] = C_NUMBER, ['N'] = C_NUMBER /* inf and nan */
+};
+
+static const Fl_Object p_rpr; /* ")" */
+#define rpr (*(Fl_Object *)&p_rpr)
+
+static Fl_Object *p_read(Fl_Context *ctx, Fl_Reader *r);
+
+/* the buffer ran out, get the next character from the reader's function if it has one */
+static int p_fill(Fl_Context *ctx, Fl_Reader *r) {
+    if (!r->fn)
+        return '\0';
+    r->c = r->fn(ctx, r->data);
+    r->pos = &r->c;
+    r->end = &r->c + (r->c != '\0');
+    return (unsigned char)r->c;
+}
+
+static inline int p_peek(Fl_Context *ctx, Fl_Reader *r) {
+    return r->pos < r->end ? (unsigned char)*r->pos : p_fill(ctx, r);
+}
+
+static void p_grow_scratch(Fl_Context *ctx) {
+    size_t cap = ctx->scratch_cap ? ctx->scratch_cap * 2 : 256;
+    char *scratch = realloc(ctx->scratch, cap);
+    if (!scratch)
+        Fl_error(ctx, "I'm out of memory :(");
+    ctx->scratch = scratch;
+    ctx->scratch_cap = cap;
+}
+
+/* skip whitespace and comments, returns the character after them */
+static int p_skip(Fl_Context *ctx, Fl_Reader *r) {
+    for (;;) {
+        /* runs of spaces and whole comments are skipped right in the buffer */
+        while (r->pos < r->end && p_class[(unsigned char)*r->pos] & C_SPACE)
+            ++r->pos;
+        int c = p_peek(ctx, r);
+        if (c == '#') {
+            const char *nl = memchr(r->pos, '\n', r->end - r->pos);
+            if (nl) {
+                r->pos = nl + 1;
+                continue;
+            }
+            while ((c = p_peek(ctx, r)) && c != '\n')
+                ++r->pos;
+            if (!c)
+                return c;
+        } else if (!c || !(p_class[c] & C_SPACE)) {
+            return c;
+        }
+        ++r->pos;
+    }
+}
+
+/* number in `buf` if all of it is one, decimal integers that fit a double exactly are done here */
+static bool p_number(const char *buf, size_t len, Fl_Number *n) {
+    const char *s = buf + (*buf == '-' || *buf == '+');
+    size_t digits = len - (s - buf);
+    if (digits && digits <= 15) {
+        Fl_Number v = 0;
+        for (; *s >= '0' && *s <= '9'; ++s)
+            v = v * 10 + (*s - '0');
+        if (!*s) {
+            *n = *buf == '-' ? -v : v;
+            return true;
+        }
+    }
+    char *end;
+    *n = strtod(buf, &end);
+    return end != buf && !*end;
+}
+
+static Fl_Object *p_list(Fl_Context *ctx, Fl_Reader *r) {
+    Fl_Object *res = &nil, *last = NULL, *value, *next;
+    if (++ctx->nesting > MAX_NESTING)
+        Fl_error(ctx, "lists are nested way too deep :(");
+    int gc = Fl_Gc_save(ctx);
+    Fl_Gc_push(ctx, res);
+    while ((value = p_read(ctx, r)) != &rpr) {
+        if (value == NULL)
+            Fl_error(ctx, "list is missing a closing parenthesis ')', remember, you need to close it!");
+        bool dotted = M_type(value) == T_SYMBOL && Fl_str_equal(M_first(M_rest(value)), ".");
+        /* dotted pair, or proper pair */
+        next = dotted ? Fl_read_from(ctx, r) : Fl_T_cons(ctx, value, &nil);
+        /* the list may have been promoted to the old space while reading */
+        if (last) {
+            M_rest(last) = next;
+            M_barrier(ctx, last);
+        } else {
+            res = next;
+        }
+        if (!dotted)
+            last = next;
+        Fl_Gc_restore(ctx, gc);
+        Fl_Gc_push(ctx, res);
+    }
+    --ctx->nesting;
+    return res;
+}
+
+static Fl_Object *p_string(Fl_Context *ctx, Fl_Reader *r) {
+    size_t len = 0;
+    int c;
+    for (; (c = p_peek(ctx, r)) != '"'; ++r->pos) {
+        if (c == '\0')
+            Fl_error(ctx, "string is missing a closing quote '\"'");
+        if (c == '\\') { /* escape sequences */
+            ++r->pos;
+            if (!(c = p_peek(ctx, r)))
+                Fl_error(ctx, "string is missing a closing quote '\"'");
+            if (strchr("nrt", c))
+                c = strchr("n\nr\rt\t", c)[1];
+        }
+        if (len == ctx->scratch_cap)
+            p_grow_scratch(ctx);
+        ctx->scratch[len++] = c;
+    }
+    ++r->pos;
+    return Fl_str_make(ctx, ctx->scratch, len);
+}
+
+/* a symbol or a number, up to the next delimiter */
+static Fl_Object *p_atom(Fl_Context *ctx, Fl_Reader *r, int c) {
+    char buf[MAX_BUF_LEN], *s = buf;
+    do {
+        if (s == &buf[sizeof(buf) - 1])
+            Fl_error(ctx, "symbol is too long (do you really need THAT many character? ;))");
+        *s++ = c;
+        ++r->pos;
+        c = p_peek(ctx, r);
+    } while (!(p_class[c] & C_DELIM));
+    *s = '\0';
+    size_t len = s - buf;
+    Fl_Number n;
+    if (p_class[(unsigned char)*buf] & C_NUMBER && p_number(buf, len, &n))
+        return Fl_T_number(ctx, n);
+    if (strcmp(buf, "nil") == 0)
+        return &nil;
+    return Fl_Symtab_intern(ctx, buf, len);
+}
+
+static Fl_Object *p_read(Fl_Context *ctx, Fl_Reader *r) {
+    Fl_Object *value;
+    int c = p_skip(ctx, r);
+
+    switch (c) {
+    case '\0':
+        return NULL;
+    case ')':
+        ++r->pos;
+        return &rpr;
+    case '(':
+        ++r->pos;
+        return p_list(ctx, r);
+    case '\'':
+        ++r->pos;
+        if (!(value = Fl_read_from(ctx, r)))
+            Fl_error(ctx, "unexpected quote (\"'\")");
+        return Fl_T_cons(ctx, Fl_T_symbol(ctx, "quote"), Fl_T_cons(ctx, value, &nil));
+    case '"':
+        ++r->pos;
+        return p_string(ctx, r);
+    default:
+        return p_atom(ctx, r, c);
+    }
+}
+
+Fl_Object *Fl_read_from(Fl_Context *ctx, Fl_Reader *r) {
+    Fl_Object *obj = p_read(ctx, r);
+    if (obj == &rpr)
+        Fl_error(ctx, "unexpected parenthesis ')'");
+    return obj;
+}
+
+void Fl_reader_buf(Fl_Reader *r, const char *buf, size_t len) {
+    memset(r, 0, sizeof(*r));
+    r->pos = buf;
+    r->end = buf + len;
+}
+
+void Fl_reader_fn(Fl_Reader *r, Fl_Read_fn fn, void *data) {
+    memset(r, 0, sizeof(*r));
+    r->pos = r->end = &r->c;
+    r->fn = fn;
+    r->data = data;
+}
+
+static char p_readfp(Fl_Context *ctx, void *data) {
+    M_unused(ctx);
+    int c;
+    return (c = fgetc(data)) != EOF ? c : '\0';
+}
+
+/*
+ * regular files are mapped and read in place, anything else (a terminal, a pipe) as it comes. so is
+ * stdin, even redirected from a file: `read` takes what follows from it, which a mapping would leave
+ * where it was
+ */
+void Fl_reader_file(Fl_Reader *r, FILE *fp) {
+    struct stat st;
+    long at = fp != stdin ? ftell(fp) : -1;
+    if (at >= 0 && !fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > at) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            Fl_reader_buf(r, (const char *)map + at, st.st_size - at);
+            r->map = map;
+            r->map_len = st.st_size;
+            return;
+        }
+    }
+    Fl_reader_fn(r, p_readfp, fp);
+}
+
+void Fl_reader_close(Fl_Reader *r) {
+    if (r->map)
+        munmap(r->map, r->map_len);
+    r->map = NULL;
+    r->pos = r->end;
+}
+
+Fl_Object *Fl_read(Fl_Context *ctx, Fl_Read_fn fn, void *data) {
+    Fl_Reader r;
+    Fl_reader_fn(&r, fn, data);
+    /* a character read past the end of the last object is kept for the next call */
+    if (ctx->next_char) {
+        r.c = ctx->next_char;
+        r.end = r.pos + 1;
+        ctx->next_char = '\0';
+    }
+    Fl_Object *obj = Fl_read_from(ctx, &r);
+    if (r.pos < r.end)
+        ctx->next_char = *r.pos;
+    return obj;
+}
+
+Fl_Object *Fl_readfp(Fl_Context *ctx, FILE *fp) {
+    return Fl_read(ctx, p_readfp, fp);
+}
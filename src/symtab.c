@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "symtab.h"
+#include "type.h"
+#include "gc.h"
+
+#define SYMTAB_INIT_SIZE 256
+#define SYMTAB_TOMB      (&nil) /* marks a deleted slot, nil is never interned */
+
+#define M_symname(S)     (M_first(M_rest(S)))
+#define M_symvalue(S)    (M_rest(M_rest(S)))
+
+/* FNV-1a, cheap and good enough for identifiers */
+static unsigned p_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void p_alloc(Fl_Context *ctx, Fl_Symtab *tab, int cap) {
+    tab->syms = calloc(cap, sizeof(*tab->syms));
+    tab->hashes = malloc(cap * sizeof(*tab->hashes));
+    if (!tab->syms || !tab->hashes)
+        Fl_error(ctx, "could not allocate symbol table");
+    tab->cap = cap;
+    tab->count = tab->used = 0;
+}
+
+static void p_insert(Fl_Symtab *tab, Fl_Object *sym, unsigned hash) {
+    int mask = tab->cap - 1, i = hash & mask;
+    while (tab->syms[i] && tab->syms[i] != SYMTAB_TOMB)
+        i = (i + 1) & mask;
+    if (!tab->syms[i])
+        ++tab->used;
+    tab->syms[i] = sym;
+    tab->hashes[i] = hash;
+    ++tab->count;
+}
+
+static void p_resize(Fl_Context *ctx, int cap) {
+    Fl_Symtab old = ctx->symtab;
+    p_alloc(ctx, &ctx->symtab, cap);
+    for (int i = 0; i < old.cap; ++i)
+        if (old.syms[i] && old.syms[i] != SYMTAB_TOMB)
+            p_insert(&ctx->symtab, old.syms[i], old.hashes[i]);
+    free(old.syms);
+    free(old.hashes);
+}
+
+void Fl_Symtab_init(Fl_Context *ctx) {
+    p_alloc(ctx, &ctx->symtab, SYMTAB_INIT_SIZE);
+    ctx->symtab.version = 1;
+}
+
+void Fl_Symtab_free(Fl_Context *ctx) {
+    free(ctx->symtab.syms);
+    free(ctx->symtab.hashes);
+    memset(&ctx->symtab, 0, sizeof(ctx->symtab));
+}
+
+Fl_Object *Fl_Symtab_intern(Fl_Context *ctx, const char *name, size_t len) {
+    Fl_Symtab *tab = &ctx->symtab;
+    unsigned hash = p_hash(name, len);
+    /* probe for an existing symbol, comparing names only on a full hash match */
+    for (int mask = tab->cap - 1, i = hash & mask; tab->syms[i]; i = (i + 1) & mask) {
+        Fl_Object *sym = tab->syms[i];
+        if (sym != SYMTAB_TOMB && tab->hashes[i] == hash && M_string(M_symname(sym))->len == len
+            && !memcmp(M_string(M_symname(sym))->data, name, len))
+            return sym;
+    }
+    /* wasn't found, create a new object; this may collect, so probe again afterwards */
+    Fl_Object *sym = Fl_object(ctx);
+    M_settype(sym, T_SYMBOL);
+    M_rest(sym) = &nil;
+    M_rest(sym) = Fl_T_cons(ctx, Fl_str_make(ctx, name, len), &nil);
+    M_barrier(ctx, sym);
+    if ((tab->used + 1) * 4 > tab->cap * 3)
+        p_resize(ctx, tab->count * 2 >= tab->cap ? tab->cap * 2 : tab->cap);
+    p_insert(tab, sym, hash);
+    return sym;
+}
+
+void Fl_Symtab_mark(Fl_Context *ctx) {
+    /* symbols holding a global value are roots, the rest live only while referenced */
+    Fl_Symtab *tab = &ctx->symtab;
+    for (int i = 0; i < tab->cap; ++i) {
+        Fl_Object *sym = tab->syms[i];
+        if (sym && sym != SYMTAB_TOMB && !M_isnil(M_symvalue(sym)))
+            Fl_Gc_mark(ctx, sym);
+    }
+}
+
+void Fl_Symtab_sweep(Fl_Context *ctx) {
+    /* called between mark and sweep: forget symbols nobody refers to anymore */
+    Fl_Symtab *tab = &ctx->symtab;
+    for (int i = 0; i < tab->cap; ++i) {
+        Fl_Object *sym = tab->syms[i];
+        if (sym && sym != SYMTAB_TOMB && !Fl_Gc_marked(ctx, sym)) {
+            tab->syms[i] = SYMTAB_TOMB;
+            --tab->count;
+        }
+    }
+}
@@ -1,19 +1,24 @@
 #include <string.h>
 
 #include "type.h"
+#include "symtab.h"
+#include "gc.h"
 
-Fl_Object *Fl_str_make(Fl_Context *ctx, Fl_Object *tail, int c) {
-    if (!tail || M_strbuf(tail)[STR_BUF_SIZE - 1]) {
-        Fl_Object *obj = Fl_T_cons(ctx, NULL, &nil);
-        M_settype(obj, T_STRING);
-        if (tail) {
-            M_rest(tail) = obj;
-            --ctx->gcstack_index;
-        }
-        tail = obj;
-    }
-    M_strbuf(tail)[strlen(M_strbuf(tail))] = c;
-    return tail;
+/* a string object holding a copy of the `len` bytes at `str` */
+Fl_Object *Fl_str_make(Fl_Context *ctx, const char *str, size_t len) {
+    Fl_Object *obj = Fl_object(ctx);
+    M_settype(obj, T_STRING);
+    M_rest(obj) = NULL; /* in case malloc fails */
+    Fl_String *s = malloc(sizeof(Fl_String) + len + 1);
+    if (!s)
+        Fl_error(ctx, "I'm out of memory :(");
+    s->len = len;
+    memcpy(s->data, str, len);
+    s->data[len] = '\0';
+    M_rest(obj) = (Fl_Object *)s;
+    /* the bytes off the heap bring the next collection closer as well */
+    ctx->heap.nursery += len / sizeof(Fl_Object);
+    return obj;
 }
 
 Fl_Object *Fl_T_cons(Fl_Context *ctx, Fl_Object *car, Fl_Object *cdr) {
@@ -27,32 +32,34 @@ Fl_Object *Fl_T_bool(Fl_Context *ctx, bool b) {
     return b ? ctx->t : &nil;
 }
 
+/*
+ * Numbers with an exponent in the middle of the range (magnitudes from about 1e-77 to 1e77) don't
+ * take a cell: the bits are rotated left by 3, so that the sign lands in bit 2, and the two low bits
+ * are set to 10, which no pointer to a cell ends in. The top two exponent bits that get overwritten
+ * are always 01 or 10 for those numbers, the next one tells which. +0.0 reuses the slot of the one
+ * pattern in that range that is boxed, everything else (-0.0, huge, tiny, inf, nan) gets a T_NUMBER cell.
+ */
 Fl_Object *Fl_T_number(Fl_Context *ctx, Fl_Number n) {
+#if FL_IMMEDIATES
+    union { Fl_Number n; uint64_t v; } t = { n };
+    int bits = (int)(t.v >> 60 & 7);
+    if (t.v != 0x3000000000000000 && (bits == 3 || bits == 4))
+        return (Fl_Object *)(uintptr_t)(((t.v << 3 | t.v >> 61) & ~(uint64_t)1) | 2);
+    if (t.v == 0)
+        return (Fl_Object *)FL_IMM_ZERO;
+#endif
     Fl_Object *obj = Fl_object(ctx);
     M_settype(obj, T_NUMBER);
-    M_number(obj) = n;
+    obj->cdr.n = n;
     return obj;
 }
 
 Fl_Object *Fl_T_string(Fl_Context *ctx, const char *str) {
-    Fl_Object *obj = Fl_str_make(ctx, NULL, '\0'),
-        *tail = obj;
-    while (*str)
-        tail = Fl_str_make(ctx, tail, *str++);
-    return obj;
+    return Fl_str_make(ctx, str, strlen(str));
 }
 
 Fl_Object *Fl_T_symbol(Fl_Context *ctx, const char *name) {
-    /* try to find it in the symbol list */
-    for (Fl_Object *obj = ctx->sym_list; !M_isnil(obj); obj = M_rest(obj))
-        if (Fl_str_equal(M_first(M_rest(M_first(obj))), name))
-            return M_first(obj);
-    /* wasn't found, create a new object, push to symbol list and return */
-    Fl_Object *new_obj = Fl_object(ctx);
-    M_settype(new_obj, T_SYMBOL);
-    M_rest(new_obj) = Fl_T_cons(ctx, Fl_T_string(ctx, name), &nil);
-    ctx->sym_list = Fl_T_cons(ctx, new_obj, ctx->sym_list);
-    return new_obj;
+    return Fl_Symtab_intern(ctx, name, strlen(name));
 }
 
 Fl_Object *Fl_T_cfunc(Fl_Context *ctx, Fl_CFunc fn) {
@@ -68,3 +75,35 @@ Fl_Object *Fl_T_ptr(Fl_Context *ctx, void *ptr) {
     M_rest(obj) = ptr;
     return obj;
 }
+
+/* a vector of the `n` objects at `items`, room is made for at least a few more */
+Fl_Object *Fl_T_vector(Fl_Context *ctx, Fl_Object **items, size_t n) {
+    Fl_Object *obj = Fl_object(ctx);
+    size_t cap = n < 4 ? 4 : n;
+    M_settype(obj, T_VECTOR);
+    M_rest(obj) = NULL; /* in case malloc fails */
+    Fl_Vector *v = malloc(sizeof(Fl_Vector) + cap * sizeof(*v->items));
+    if (!v)
+        Fl_error(ctx, "I'm out of memory :(");
+    v->len = n;
+    v->cap = cap;
+    if (n)
+        memcpy(v->items, items, n * sizeof(*items));
+    M_rest(obj) = (Fl_Object *)v;
+    ctx->heap.nursery += cap;
+    return obj;
+}
+
+void Fl_vec_push(Fl_Context *ctx, Fl_Object *vec, Fl_Object *item) {
+    Fl_Vector *v = M_vector(vec);
+    if (v->len == v->cap) {
+        size_t cap = v->cap * 2;
+        if (!(v = realloc(v, sizeof(Fl_Vector) + cap * sizeof(*v->items))))
+            Fl_error(ctx, "I'm out of memory :(");
+        ctx->heap.nursery += cap - v->cap;
+        v->cap = cap;
+        M_rest(vec) = (Fl_Object *)v;
+    }
+    v->items[v->len++] = item;
+    M_barrier(ctx, vec);
+}
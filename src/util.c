@@ -61,3 +61,27 @@ char *strip(char *str) {
     end[1] = '\0';
     return str;
 }
+
+/* a byte count with an optional k, m or g suffix, e.g. "512k" or "2g" */
+bool parse_size(const char *str, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (end == str || *str == '-')
+        return false;
+    switch (tolower((unsigned char)*end)) {
+    case 'g':
+        n *= 1024;
+        /* FALLTHROUGH */
+    case 'm':
+        n *= 1024;
+        /* FALLTHROUGH */
+    case 'k':
+        n *= 1024;
+        ++end;
+        break;
+    }
+    if (*end)
+        return false;
+    *size = n;
+    return true;
+}
@@ -0,0 +1,1476 @@
+/* Bytecode compiler and virtual machine */
+
+#include <string.h>
+
+#include "vm.h"
+#include "type.h"
+#include "gc.h"
+#include "map.h"
+#include "prof.h"
+
+#if defined(__GNUC__) && !defined(FL_NO_COMPUTED_GOTO)
+#define FL_COMPUTED_GOTO
+#endif
+
+/* opcode        operands                   effect                                               */
+#define VM_OPCODES(X)                                                                              \
+    X(OP_NIL,       "")                  /* push nil                                            */ \
+    X(OP_CONST,     "k")                 /* push constant k                                     */ \
+    X(OP_LOCAL,     "i")                 /* push slot i of the current frame                    */ \
+    X(OP_UPVAL,     "d i")               /* push slot i of the frame d levels up                */ \
+    X(OP_GLOBAL,    "k")                 /* push the global value of symbol k                   */ \
+    X(OP_SETLOCAL,  "i")                 /* assign top to a slot, replace it by nil             */ \
+    X(OP_SETUPVAL,  "d i")               /*                                                     */ \
+    X(OP_SETGLOBAL, "k")                 /*                                                     */ \
+    X(OP_BIND,      "i")                 /* pop into slot i of the current frame                */ \
+    X(OP_POP,       "")                  /* drop top                                            */ \
+    X(OP_JUMP,      "to")                /*                                                     */ \
+    X(OP_JUMPNIL,   "to")                /* pop, jump if it was nil                             */ \
+    X(OP_AND,       "to")                /* jump if top is nil, pop otherwise                   */ \
+    X(OP_OR,        "to")                /* jump if top isn't nil, pop otherwise                */ \
+    X(OP_FRAME,     "n")                 /* enter a new frame of n slots                        */ \
+    X(OP_ENDFRAME,  "")                  /* leave it                                            */ \
+    X(OP_FUNC,      "k")                 /* push a function closing over prototype k            */ \
+    X(OP_MACRO,     "k")                 /* push a macro closing over prototype k               */ \
+    X(OP_CALLSYM,   "k c skip d l site") /* push global callee symbol k, then CALLEE            */ \
+    X(OP_CALLEE,    "skip d l site")     /* check the callee on top, expand if a macro          */ \
+    X(OP_CALL,      "n site")            /* call callee below n arguments                       */ \
+    X(OP_TAILCALL,  "n site")            /* same, a function replaces this activation           */ \
+    X(OP_BUILTIN,   "k c n site")        /* call built-in symbol k is bound to on n arguments   */ \
+    X(OP_FOLD,      "c g k len")         /* push k, skip len words if guard g holds, see p_fold */ \
+    X(OP_RETURN,    "")                  /* return top to the caller                            */ \
+    X(OP_ERROR,     "k site")            /* raise error message k                               */
+
+#define M_enum(OP, OPERANDS) OP,
+#define M_name(OP, OPERANDS) #OP,
+#define M_operands(OP, OPERANDS) OPERANDS,
+
+enum { VM_OPCODES(M_enum) OP_LEN };
+
+#define M_symvalue(S) (M_rest(M_rest(S)))
+
+typedef struct {
+    Fl_Context *ctx;
+    Fl_Object *code;
+    Fl_Code *c;
+    int decl; /* innermost visible local, -1 if none */
+    int level; /* frames entered by loops at this point of the code */
+    int slots; /* slots used so far in the innermost frame */
+    int closures; /* functions and macros made so far */
+    int depth; /* value stack depth at this point of the code */
+    bool tail; /* the next expression's value is what the activation returns */
+} p_Compiler;
+
+static Fl_Code *p_compile(Fl_Context *ctx, Fl_Object *code);
+static Fl_Object *p_expand(Fl_Context *ctx, Fl_Object *macro, Fl_Object *args);
+static Fl_Object *p_builtin(Fl_Context *ctx, int id, Fl_Object **argv, int argc);
+static void p_compile_expr(p_Compiler *cs, Fl_Object *form);
+static void p_compile_body(p_Compiler *cs, Fl_Object *forms);
+static void p_compile_loop_body(p_Compiler *cs, Fl_Object *forms);
+
+/*
+ * Compiler
+ */
+
+static void *p_grow(Fl_Context *ctx, void *ptr, int *cap, int need, size_t size) {
+    if (need <= *cap)
+        return ptr;
+    int n = *cap ? *cap : 16;
+    while (n < need)
+        n *= 2;
+    if (!(ptr = realloc(ptr, n * size)))
+        Fl_error(ctx, "compiler is out of memory :(");
+    *cap = n;
+    return ptr;
+}
+
+static int p_emit(p_Compiler *cs, int word) {
+    Fl_Code *c = cs->c;
+    c->ops = p_grow(cs->ctx, c->ops, &c->capops, c->nops + 1, sizeof(*c->ops));
+    c->ops[c->nops] = word;
+    return c->nops++;
+}
+
+static int p_const(p_Compiler *cs, Fl_Object *obj) {
+    Fl_Code *c = cs->c;
+    c->consts = p_grow(cs->ctx, c->consts, &c->capconsts, c->nconsts + 1, sizeof(*c->consts));
+    c->consts[c->nconsts] = obj;
+    M_barrier(cs->ctx, cs->code); /* compiling allocates, the code may not be young anymore */
+    return c->nconsts++;
+}
+
+/* a cache for a call site with a global callee, see Fl_Cache */
+static int p_cache(p_Compiler *cs) {
+    Fl_Code *c = cs->c;
+    c->caches = p_grow(cs->ctx, c->caches, &c->capcaches, c->ncaches + 1, sizeof(*c->caches));
+    c->caches[c->ncaches].version = 0;
+    c->caches[c->ncaches].callee = NULL;
+    return c->ncaches++;
+}
+
+static void p_depth(p_Compiler *cs, int delta) {
+    cs->depth += delta;
+    if (cs->depth > cs->c->maxstack)
+        cs->c->maxstack = cs->depth;
+}
+
+/* make `sym` a local in the innermost frame, visible from here on, returns its slot */
+static int p_declare(p_Compiler *cs, Fl_Object *sym) {
+    Fl_Code *c = cs->c;
+    c->decls = p_grow(cs->ctx, c->decls, &c->capdecls, c->ndecls + 1, sizeof(*c->decls));
+    Fl_Decl *d = &c->decls[c->ndecls];
+    d->sym = sym;
+    d->slot = cs->slots++;
+    d->level = cs->level;
+    d->prev = cs->decl;
+    M_barrier(cs->ctx, cs->code);
+    cs->decl = c->ndecls++;
+    return d->slot;
+}
+
+/* the frame (counted outwards from the current one) and slot holding local `sym` */
+static bool p_resolve(p_Compiler *cs, Fl_Object *sym, int *depth, int *slot) {
+    Fl_Code *c = cs->c;
+    int d = cs->decl, level = cs->level, up = 0;
+    for (;;) {
+        for (; d >= 0; d = c->decls[d].prev) {
+            if (c->decls[d].sym == sym) {
+                *depth = up + level - c->decls[d].level;
+                *slot = c->decls[d].slot;
+                return true;
+            }
+        }
+        if (M_isnil(c->parent))
+            return false;
+        /* past the loop frames and the activation frame lies the frame the code was closed in */
+        up += level + 1;
+        d = c->parent_decl;
+        level = c->parent_level;
+        c = M_code(c->parent);
+    }
+}
+
+static bool p_bound(p_Compiler *cs, Fl_Object *sym) {
+    int depth, slot;
+    return p_resolve(cs, sym, &depth, &slot);
+}
+
+static void p_variable(p_Compiler *cs, Fl_Object *sym, int op_local, int op_upval, int op_global) {
+    int depth, slot;
+    if (!p_resolve(cs, sym, &depth, &slot)) {
+        p_emit(cs, op_global);
+        p_emit(cs, p_const(cs, sym));
+    } else if (!depth) {
+        p_emit(cs, op_local);
+        p_emit(cs, slot);
+    } else {
+        p_emit(cs, op_upval);
+        p_emit(cs, depth);
+        p_emit(cs, slot);
+    }
+}
+
+static bool p_is_special(int id) {
+    switch (id) {
+    case BI_LET: case BI_SET: case BI_IF: case BI_FN: case BI_MACRO: case BI_WHILE:
+    case BI_QUOTE: case BI_EVAL: case BI_AND: case BI_OR: case BI_DO:
+        return true;
+    }
+    return false;
+}
+
+/* whether `fn` is called as it is, without being expanded first */
+static bool p_callable(Fl_Object *fn) {
+    switch (M_type(fn)) {
+    case T_FUNC: case T_CFUNC:
+        return true;
+    case T_BUILTIN:
+        return !p_is_special(M_builtin(fn));
+    }
+    return false;
+}
+
+/* what `head` calls at compile time, as long as no local shadows it */
+static Fl_Object *p_callee(p_Compiler *cs, Fl_Object *head) {
+    if (M_type(head) == T_SYMBOL)
+        return p_bound(cs, head) ? &nil : M_symvalue(head);
+    return head;
+}
+
+static int p_special(p_Compiler *cs, Fl_Object *form) {
+    if (M_type(form) != T_PAIR)
+        return -1;
+    Fl_Object *fn = p_callee(cs, M_first(form));
+    return M_type(fn) == T_BUILTIN && p_is_special(M_builtin(fn)) ? M_builtin(fn) : -1;
+}
+
+/* expand macro calls known at compile time, the result is left on the gc stack */
+static Fl_Object *p_expand_all(p_Compiler *cs, Fl_Object *form) {
+    Fl_Object *fn;
+    while (M_type(form) == T_PAIR && M_type(fn = p_callee(cs, M_first(form))) == T_MACRO)
+        form = p_expand(cs->ctx, fn, M_rest(form));
+    return form;
+}
+
+/* emit code raising `message` when (and only if) execution gets here */
+static void p_fail(p_Compiler *cs, int base, const char *message, Fl_Object *form) {
+    p_emit(cs, OP_ERROR);
+    p_emit(cs, p_const(cs, Fl_T_string(cs->ctx, message)));
+    p_emit(cs, p_const(cs, form));
+    cs->depth = base;
+    p_depth(cs, 1);
+}
+
+static bool p_check(p_Compiler *cs, int base, Fl_Object *obj, Fl_Type type, Fl_Object *form) {
+    char buf[MAX_BUF_LEN];
+    if ((Fl_Type)M_type(obj) == type)
+        return true;
+    snprintf(buf, sizeof(buf), "expected %s but got %s", Fl_type_name(type), Fl_type_name(M_type(obj)));
+    p_fail(cs, base, buf, form);
+    return false;
+}
+
+/* next argument of special form `form`, NULL if there's none (an error is emitted then) */
+static Fl_Object *p_arg(p_Compiler *cs, Fl_Object **args, int base, Fl_Object *form) {
+    Fl_Object *a = *args;
+    if (M_type(a) != T_PAIR) {
+        p_fail(cs, base, M_isnil(a) ? "not enough arguments" :
+            "are you nuts? there's dotted pair in your argument list!", form);
+        return NULL;
+    }
+    *args = M_rest(a);
+    return M_first(a);
+}
+
+static void p_load(p_Compiler *cs, Fl_Object *obj) {
+    if (M_isnil(obj)) {
+        p_emit(cs, OP_NIL);
+    } else {
+        p_emit(cs, OP_CONST);
+        p_emit(cs, p_const(cs, obj));
+    }
+    p_depth(cs, 1);
+}
+
+static void p_patch(p_Compiler *cs, int at) {
+    cs->c->ops[at] = cs->c->nops;
+}
+
+/* forward jumps to a common end are chained through their operands until patched */
+static int p_jump(p_Compiler *cs, int op, int chain) {
+    p_emit(cs, op);
+    return p_emit(cs, chain);
+}
+
+static void p_patch_chain(p_Compiler *cs, int chain) {
+    while (chain >= 0) {
+        int next = cs->c->ops[chain];
+        p_patch(cs, chain);
+        chain = next;
+    }
+}
+
+static void p_compile_if(p_Compiler *cs, Fl_Object *form, int base, bool tail) {
+    Fl_Object *args = M_rest(form), *x;
+    int ends = -1;
+
+    if (M_isnil(args))
+        p_load(cs, &nil);
+    while (!M_isnil(args)) {
+        cs->depth = base;
+        if (!(x = p_arg(cs, &args, base, form)))
+            break;
+        cs->tail = tail && M_isnil(args); /* a trailing condition is its own value */
+        p_compile_expr(cs, x);
+        if (M_isnil(args))
+            break;
+        int next = p_jump(cs, OP_JUMPNIL, -1);
+        p_depth(cs, -1);
+        if ((x = p_arg(cs, &args, base, form))) {
+            cs->tail = tail;
+            p_compile_expr(cs, x);
+            ends = p_jump(cs, OP_JUMP, ends);
+        }
+        p_patch(cs, next);
+        if (!x)
+            break;
+        if (M_isnil(args)) {
+            cs->depth = base;
+            p_load(cs, &nil);
+        }
+    }
+    p_patch_chain(cs, ends);
+    cs->depth = base;
+    p_depth(cs, 1);
+}
+
+static void p_compile_logic(p_Compiler *cs, Fl_Object *form, int op, int base, bool tail) {
+    Fl_Object *args = M_rest(form), *x;
+    int ends = -1;
+
+    if (M_isnil(args))
+        p_load(cs, &nil);
+    while (!M_isnil(args) && (x = p_arg(cs, &args, base, form))) {
+        cs->tail = tail && M_isnil(args);
+        p_compile_expr(cs, x);
+        if (!M_isnil(args)) {
+            ends = p_jump(cs, op, ends);
+            p_depth(cs, -1);
+        }
+    }
+    p_patch_chain(cs, ends);
+    cs->depth = base;
+    p_depth(cs, 1);
+}
+
+static void p_compile_closure(p_Compiler *cs, Fl_Object *form, int op, int base) {
+    Fl_Object *args = M_rest(form), *params, *proto;
+    if (!(params = p_arg(cs, &args, base, form)))
+        return;
+    /* the prototype remembers where it is, it gets compiled on first call */
+    proto = Fl_Code_make(cs->ctx, params, args);
+    M_code(proto)->parent = cs->code;
+    M_code(proto)->parent_decl = cs->decl;
+    M_code(proto)->parent_level = cs->level;
+    M_barrier(cs->ctx, proto);
+    p_emit(cs, op);
+    p_emit(cs, p_const(cs, proto));
+    p_depth(cs, 1);
+    ++cs->closures;
+}
+
+static bool p_foldable(int id) {
+    switch (id) {
+    case BI_ADD: case BI_SUB: case BI_MUL: case BI_DIV:
+        return true;
+    }
+    return false;
+}
+
+static bool p_comparison(int id) {
+    switch (id) {
+    case BI_EQ: case BI_LT: case BI_LE: case BI_GT: case BI_GE:
+        return true;
+    }
+    return false;
+}
+
+/* whether the symbols of the (symbol . built-in) pairs in `guard` are still bound to those built-ins */
+static bool p_guard(Fl_Object *guard) {
+    for (; !M_isnil(guard); guard = M_rest(guard)) {
+        Fl_Object *fn = M_symvalue(M_first(M_first(guard)));
+        if (M_type(fn) != T_BUILTIN || M_builtin(fn) != M_builtin(M_rest(M_first(guard))))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * when the arguments from `from` up to the call to built-in `fn` at `call` are only numbers, loaded
+ * or folded, put an OP_FOLD in front of them: it pushes the result and skips them and the call for
+ * as long as the built-ins it was worked out with are bound to the same symbols
+ */
+static void p_fold(p_Compiler *cs, Fl_Object *form, Fl_Object *fn, int from, int call, int n) {
+    Fl_Context *ctx = cs->ctx;
+    Fl_Code *c = cs->c;
+    Fl_Object *args[VM_MAX_FOLD];
+    int id = M_builtin(fn), pc = from;
+    if ((!(p_foldable(id) && n >= 1) && !(p_comparison(id) && n == 2)) || n > VM_MAX_FOLD)
+        return;
+
+    int gc = Fl_Gc_save(ctx);
+    Fl_Object *guard = Fl_T_cons(ctx, Fl_T_cons(ctx, M_first(form), fn), &nil);
+    for (int i = 0; i < n && pc < call; ++i) {
+        if (c->ops[pc] == OP_CONST && M_type(c->consts[c->ops[pc + 1]]) == T_NUMBER) {
+            args[i] = c->consts[c->ops[pc + 1]];
+            pc += 2;
+        } else if (c->ops[pc] == OP_FOLD) {
+            args[i] = c->consts[c->ops[pc + 3]];
+            for (Fl_Object *g = c->consts[c->ops[pc + 2]]; !M_isnil(g); g = M_rest(g))
+                guard = Fl_T_cons(ctx, M_first(g), guard);
+            pc += 5 + c->ops[pc + 4];
+        } else {
+            break;
+        }
+    }
+    /* n numbers that end where the call starts are the arguments, not (vector 1 2) */
+    if (pc != call) {
+        Fl_Gc_restore(ctx, gc);
+        return;
+    }
+    Fl_Object *res = p_builtin(ctx, id, args, n);
+    int len = c->nops - from;
+    c->ops = p_grow(ctx, c->ops, &c->capops, c->nops + 5, sizeof(*c->ops));
+    memmove(&c->ops[from + 5], &c->ops[from], len * sizeof(*c->ops));
+    c->nops += 5;
+    c->ops[from] = OP_FOLD;
+    c->ops[from + 1] = p_cache(cs);
+    c->ops[from + 2] = p_const(cs, guard);
+    c->ops[from + 3] = p_const(cs, res);
+    c->ops[from + 4] = len;
+    Fl_Gc_restore(ctx, gc);
+}
+
+/*
+ * a built-in known at compile time is called without going through the callee checks, and its
+ * result is folded when its operands are constant numbers. the call still goes through the symbol,
+ * which is checked to hold a built-in each time.
+ */
+static void p_compile_builtin(p_Compiler *cs, Fl_Object *form, Fl_Object *fn, int base) {
+    Fl_Object *args = M_rest(form);
+    int from = cs->c->nops, site = p_const(cs, form), n = 0;
+
+    for (; M_type(args) == T_PAIR; args = M_rest(args), ++n)
+        p_compile_expr(cs, M_first(args));
+    if (!M_isnil(args)) {
+        p_fail(cs, base, "are you nuts? there's dotted pair in your argument list!", form);
+    } else {
+        int call = p_emit(cs, OP_BUILTIN);
+        p_emit(cs, p_const(cs, M_first(form)));
+        p_emit(cs, p_cache(cs));
+        p_emit(cs, n);
+        p_emit(cs, site);
+        p_depth(cs, 1); /* room for the callee, should the symbol be bound to a function by then */
+        p_depth(cs, -n);
+        p_fold(cs, form, fn, from, call, n);
+    }
+}
+
+static void p_compile_call(p_Compiler *cs, Fl_Object *form, int base, bool tail) {
+    Fl_Object *head = M_first(form), *args = M_rest(form), *fn = p_callee(cs, head);
+    if (M_type(head) == T_SYMBOL && M_type(fn) == T_BUILTIN) {
+        p_compile_builtin(cs, form, fn, base);
+        return;
+    }
+
+    int skip, site = p_const(cs, form), n = 0;
+    p_const(cs, &nil); /* expansion cache for macros only known at run time */
+
+    if (M_type(head) == T_SYMBOL && !p_bound(cs, head)) {
+        p_emit(cs, OP_CALLSYM);
+        p_emit(cs, p_const(cs, head));
+        p_emit(cs, p_cache(cs));
+        p_depth(cs, 1);
+    } else {
+        p_compile_expr(cs, head);
+        p_emit(cs, OP_CALLEE);
+    }
+    skip = p_emit(cs, 0);
+    /* a macro found here at run time expands in this scope */
+    p_emit(cs, cs->decl);
+    p_emit(cs, cs->level);
+    p_emit(cs, site);
+    for (; M_type(args) == T_PAIR; args = M_rest(args), ++n)
+        p_compile_expr(cs, M_first(args));
+    if (!M_isnil(args)) {
+        p_fail(cs, base, "are you nuts? there's dotted pair in your argument list!", form);
+    } else {
+        p_emit(cs, tail && !cs->level ? OP_TAILCALL : OP_CALL);
+        p_emit(cs, n);
+        p_emit(cs, site);
+        p_depth(cs, -n);
+    }
+    p_patch(cs, skip);
+}
+
+static void p_compile_expr(p_Compiler *cs, Fl_Object *form) {
+    Fl_Context *ctx = cs->ctx;
+    Fl_Object *args, *x;
+    int gc = Fl_Gc_save(ctx), base = cs->depth;
+    bool tail = cs->tail;
+
+    cs->tail = false; /* subexpressions are not, unless said otherwise below */
+
+    form = p_expand_all(cs, form);
+    if (M_type(form) == T_SYMBOL) {
+        p_variable(cs, form, OP_LOCAL, OP_UPVAL, OP_GLOBAL);
+        p_depth(cs, 1);
+        Fl_Gc_restore(ctx, gc);
+        return;
+    }
+    if (M_type(form) != T_PAIR) {
+        p_load(cs, form);
+        Fl_Gc_restore(ctx, gc);
+        return;
+    }
+
+    args = M_rest(form);
+    switch (p_special(cs, form)) {
+    case BI_LET: /* `let` only binds inside a body, elsewhere it is a no-op */
+        if ((x = p_arg(cs, &args, base, form)) && p_check(cs, base, x, T_SYMBOL, form))
+            p_load(cs, &nil);
+        break;
+    case BI_SET:
+        if (!(x = p_arg(cs, &args, base, form)) || !p_check(cs, base, x, T_SYMBOL, form))
+            break;
+        if (!(form = p_arg(cs, &args, base, form)))
+            break;
+        p_compile_expr(cs, form);
+        p_variable(cs, x, OP_SETLOCAL, OP_SETUPVAL, OP_SETGLOBAL);
+        break;
+    case BI_IF:
+        p_compile_if(cs, form, base, tail);
+        break;
+    case BI_FN:
+        p_compile_closure(cs, form, OP_FUNC, base);
+        break;
+    case BI_MACRO:
+        p_compile_closure(cs, form, OP_MACRO, base);
+        break;
+    case BI_WHILE: {
+        if (!(x = p_arg(cs, &args, base, form)))
+            break;
+        int loop = cs->c->nops;
+        p_compile_expr(cs, x);
+        p_emit(cs, OP_JUMPNIL);
+        int end = p_emit(cs, 0);
+        p_depth(cs, -1);
+        p_compile_loop_body(cs, args);
+        p_emit(cs, OP_POP);
+        p_emit(cs, OP_JUMP);
+        p_emit(cs, loop);
+        cs->depth = base;
+        p_patch(cs, end);
+        p_load(cs, &nil);
+        break;
+    }
+    case BI_QUOTE:
+        if ((x = p_arg(cs, &args, base, form)))
+            p_load(cs, x);
+        break;
+    case BI_EVAL:
+        if ((x = p_arg(cs, &args, base, form)) && p_check(cs, base, x, T_PAIR, form)) {
+            cs->tail = tail;
+            p_compile_body(cs, x);
+        }
+        break;
+    case BI_AND:
+        p_compile_logic(cs, form, OP_AND, base, tail);
+        break;
+    case BI_OR:
+        p_compile_logic(cs, form, OP_OR, base, tail);
+        break;
+    case BI_DO:
+        cs->tail = tail;
+        p_compile_body(cs, args);
+        break;
+    default:
+        p_compile_call(cs, form, base, tail);
+        break;
+    }
+    Fl_Gc_restore(ctx, gc);
+}
+
+/* compile a `let` binding or a plain expression, returns whether it left a value */
+static bool p_compile_stmt(p_Compiler *cs, Fl_Object *form) {
+    Fl_Object *args, *sym, *value;
+    int base = cs->depth;
+    if (p_special(cs, form) != BI_LET) {
+        p_compile_expr(cs, form);
+        return true;
+    }
+    cs->tail = false; /* the body's value is nil */
+    args = M_rest(form);
+    if (!(sym = p_arg(cs, &args, base, form)) || !p_check(cs, base, sym, T_SYMBOL, form))
+        return true;
+    if (!(value = p_arg(cs, &args, base, form)))
+        return true;
+    p_compile_expr(cs, value);
+    p_emit(cs, OP_BIND);
+    p_emit(cs, p_declare(cs, sym));
+    p_depth(cs, -1);
+    return false;
+}
+
+/* a sequence of forms where `let` extends the scope of the forms after it */
+static void p_compile_body(p_Compiler *cs, Fl_Object *forms) {
+    Fl_Context *ctx = cs->ctx;
+    Fl_Object *f;
+    int gc = Fl_Gc_save(ctx), decl = cs->decl, base = cs->depth;
+    bool value = false, tail = cs->tail;
+
+    for (f = forms; M_type(f) == T_PAIR; f = M_rest(f)) {
+        if (value) {
+            p_emit(cs, OP_POP);
+            p_depth(cs, -1);
+        }
+        /* statement-level macros are expanded first, they may expand to a `let` */
+        Fl_Object *stmt = p_expand_all(cs, M_first(f));
+        cs->tail = tail && M_isnil(M_rest(f));
+        value = p_compile_stmt(cs, stmt);
+        Fl_Gc_restore(ctx, gc);
+    }
+    if (!M_isnil(f))
+        p_fail(cs, cs->depth - value, "are you nuts? there's dotted pair in your argument list!", forms);
+    else if (!value)
+        p_load(cs, &nil);
+    cs->depth = base;
+    p_depth(cs, 1);
+    cs->decl = decl;
+}
+
+/*
+ * Locals of a loop body normally live in the enclosing frame. When a closure made in the body
+ * could capture them, each iteration needs fresh ones: the body is then compiled again, this
+ * time running in a frame of its own (macros in it get expanded twice).
+ */
+static void p_compile_loop_body(p_Compiler *cs, Fl_Object *forms) {
+    Fl_Code *c = cs->c;
+    int nops = c->nops, nconsts = c->nconsts, ndecls = c->ndecls;
+    int slots = cs->slots, closures = cs->closures, base = cs->depth;
+
+    p_compile_body(cs, forms);
+    if (cs->closures == closures || cs->slots == slots)
+        return;
+    c->nops = nops;
+    c->nconsts = nconsts;
+    c->ndecls = ndecls;
+    cs->depth = base;
+    p_emit(cs, OP_FRAME);
+    int size = p_emit(cs, 0);
+    cs->slots = 0;
+    ++cs->level;
+    p_compile_body(cs, forms);
+    c->ops[size] = cs->slots;
+    --cs->level;
+    cs->slots = slots;
+    p_emit(cs, OP_ENDFRAME);
+}
+
+static Fl_Code *p_compile(Fl_Context *ctx, Fl_Object *code) {
+    Fl_Code *c = M_code(code);
+    if (c->ready)
+        return c;
+    if (c->compiling == ctx->vm->epoch + 1)
+        Fl_error(ctx, "function was called while it was being compiled");
+
+    /* (re)start from scratch, an error may have interrupted an earlier attempt */
+    p_Compiler cs = { ctx, code, c, -1, 0, 0, 0, 0, false };
+    int gc = Fl_Gc_save(ctx);
+    Fl_Gc_push(ctx, code);
+    c->compiling = ctx->vm->epoch + 1;
+    c->nops = c->nconsts = c->ncaches = c->maxstack = c->ndecls = c->nparams = 0;
+    c->rest = false;
+
+    /* parameters take the first slots of the frame, in order */
+    Fl_Object *p = c->params;
+    for (; M_type(p) == T_PAIR; p = M_rest(p), ++c->nparams)
+        p_declare(&cs, M_first(p));
+    if ((c->rest = !M_isnil(p)))
+        p_declare(&cs, p);
+    /* top-level code stays put for the call it ends with, so the form shows in tracebacks and profiles */
+    cs.tail = !c->expr || !M_isnil(c->parent);
+    if (c->expr)
+        p_compile_expr(&cs, c->body);
+    else
+        p_compile_body(&cs, c->body);
+    p_emit(&cs, OP_RETURN);
+
+    c->nslots = cs.slots;
+    c->compiling = 0;
+    c->ready = true;
+    Fl_Gc_restore(ctx, gc);
+    return c;
+}
+
+Fl_Object *Fl_Code_make(Fl_Context *ctx, Fl_Object *params, Fl_Object *body) {
+    Fl_Code *c = calloc(1, sizeof(Fl_Code));
+    if (!c)
+        Fl_error(ctx, "I'm out of memory :(");
+    c->params = params;
+    c->body = body;
+    c->parent = &nil;
+    c->parent_decl = -1;
+    Fl_Object *obj = Fl_object(ctx);
+    M_settype(obj, T_CODE);
+    M_rest(obj) = (Fl_Object *)c;
+    return obj;
+}
+
+void Fl_Code_mark(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Code *c = M_code(obj);
+    for (int i = 0; i < c->nconsts; ++i)
+        Fl_Gc_mark(ctx, c->consts[i]);
+    Fl_Gc_mark(ctx, c->params);
+    Fl_Gc_mark(ctx, c->body);
+    Fl_Gc_mark(ctx, c->parent);
+    /* names bound by macro expansions may be referenced from nowhere else */
+    for (int i = 0; i < c->ndecls; ++i)
+        Fl_Gc_mark(ctx, c->decls[i].sym);
+}
+
+void Fl_Code_free(Fl_Object *obj) {
+    Fl_Code *c = M_code(obj);
+    free(c->ops);
+    free(c->consts);
+    free(c->caches);
+    free(c->decls);
+    free(c);
+}
+
+static void p_dumps(Fl_Context *ctx, void *data, const char *s, size_t len) {
+    M_unused(ctx);
+    fwrite(s, 1, len, data);
+}
+
+Fl_Object *Fl_compile(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Object *code = Fl_Code_make(ctx, &nil, obj);
+    M_code(code)->expr = true;
+    p_compile(ctx, code);
+    return code;
+}
+
+/* compile the functions and macros `code` makes now, rather than on their first call */
+static void p_compile_nested(Fl_Context *ctx, Fl_Object *code) {
+    Fl_Code *c = M_code(code);
+    for (int i = 0; i < c->nconsts; ++i) {
+        Fl_Object *proto = c->consts[i];
+        if (M_type(proto) == T_CODE && M_code(proto)->parent == code && !M_code(proto)->ready) {
+            p_compile(ctx, proto);
+            p_compile_nested(ctx, proto);
+        }
+    }
+}
+
+static const char *const p_names[OP_LEN] = { VM_OPCODES(M_name) };
+static const char *const p_operands[OP_LEN] = { VM_OPCODES(M_operands) };
+
+static void p_dump(Fl_Context *ctx, Fl_Object *code, int indent) {
+    FILE *fp = ctx->dump;
+    Fl_Code *c = M_code(code);
+
+    for (int pc = 0; pc < c->nops;) {
+        int op = c->ops[pc];
+        fprintf(fp, "%*s%4d  %s", indent, "", pc++, p_names[op] + 3);
+        /* operands are named in VM_OPCODES, constants are shown by value and call sites not at all */
+        for (const char *o = p_operands[op]; *o; o += strcspn(o, " "), o += *o == ' ') {
+            int word = c->ops[pc++];
+            if (!strncmp(o, "site", 4))
+                continue;
+            fputc(' ', fp);
+            if (*o != 'k' || (o[1] != ' ' && o[1]))
+                fprintf(fp, "%d", word);
+            else if (M_type(c->consts[word]) == T_CODE)
+                fprintf(fp, "code %d", word); /* listed below */
+            else
+                Fl_write_spans(ctx, c->consts[word], p_dumps, fp, true);
+        }
+        fputc('\n', fp);
+    }
+    for (int i = 0; i < c->nconsts; ++i) {
+        Fl_Object *proto = c->consts[i];
+        if (M_type(proto) != T_CODE || M_code(proto)->parent != code || !M_code(proto)->ready)
+            continue;
+        fprintf(fp, "%*scode %d ", indent + 2, "", i);
+        Fl_write_spans(ctx, M_code(proto)->params, p_dumps, fp, true);
+        fputc('\n', fp);
+        p_dump(ctx, proto, indent + 2);
+    }
+}
+
+/*
+ * compile top-level form `obj` with everything in it, so that macros are expanded before anything
+ * runs and code that never runs is checked too
+ */
+Fl_Object *Fl_optimize(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Object *code = Fl_compile(ctx, obj);
+    p_compile_nested(ctx, code);
+    if (ctx->dump) {
+        fputs("; ", ctx->dump);
+        Fl_write_spans(ctx, obj, p_dumps, ctx->dump, true);
+        fputc('\n', ctx->dump);
+        p_dump(ctx, code, 0);
+    }
+    return code;
+}
+
+/*
+ * Virtual machine
+ */
+
+/* a frame of `n` slots set to nil, small ones come from the spare frames left by the gc */
+static Fl_Object *p_frame(Fl_Context *ctx, int n, Fl_Object *parent) {
+    Fl_Vm *vm = ctx->vm;
+    Fl_Object *obj = Fl_object(ctx);
+    Fl_Frame *f;
+
+    M_settype(obj, T_FRAME);
+    M_rest(obj) = NULL;
+    if (n < VM_POOL_SIZES && vm->pool[n]) {
+        f = vm->pool[n];
+        vm->pool[n] = (Fl_Frame *)f->parent;
+        --vm->npool[n];
+    } else if (!(f = malloc(sizeof(Fl_Frame) + n * sizeof(*f->slots)))) {
+        Fl_error(ctx, "I'm out of memory :(");
+    }
+    f->parent = parent;
+    f->n = n;
+    for (int i = 0; i < n; ++i)
+        f->slots[i] = &nil;
+    M_rest(obj) = (Fl_Object *)f;
+    return obj;
+}
+
+void Fl_Frame_free(Fl_Context *ctx, Fl_Object *obj) {
+    Fl_Vm *vm = ctx->vm;
+    Fl_Frame *f = M_frame(obj);
+    if (f && vm && f->n < VM_POOL_SIZES && vm->npool[f->n] < VM_POOL_MAX) {
+        f->parent = (Fl_Object *)vm->pool[f->n];
+        vm->pool[f->n] = f;
+        ++vm->npool[f->n];
+    } else {
+        free(f);
+    }
+}
+
+static void p_reserve(Fl_Context *ctx, int n) {
+    Fl_Vm *vm = ctx->vm;
+    if (vm->sp + n > vm->stack_cap) {
+        int cap = vm->stack_cap;
+        while (cap < vm->sp + n)
+            cap *= 2;
+        Fl_Object **stack = realloc(vm->stack, cap * sizeof(*stack));
+        if (!stack)
+            Fl_error(ctx, "stack overflow :(");
+        vm->stack = stack;
+        vm->stack_cap = cap;
+    }
+}
+
+static void p_push_frame(Fl_Context *ctx, Fl_Object *code, Fl_Object *env) {
+    Fl_Vm *vm = ctx->vm;
+    if (vm->depth == vm->frames_cap) {
+        Fl_Activation *frames = NULL;
+        if (vm->depth < VM_MAX_DEPTH)
+            frames = realloc(vm->frames, vm->frames_cap * 2 * sizeof(*frames));
+        if (!frames)
+            Fl_error(ctx, "stack overflow :(");
+        vm->frames = frames;
+        vm->frames_cap *= 2;
+    }
+    p_reserve(ctx, M_code(code)->maxstack);
+    Fl_Activation *fr = &vm->frames[vm->depth++];
+    fr->code = code;
+    fr->env = env;
+    fr->pc = 0;
+    fr->bp = vm->sp;
+    if (vm->sample)
+        Fl_Prof_sample(ctx, vm->depth - 1);
+}
+
+/* start running `code`, its frame (if it needs one) is closed in `env` */
+static void p_activate(Fl_Context *ctx, Fl_Object *code, Fl_Object *env) {
+    Fl_Code *c = M_code(code);
+    /* top-level code without locals is the only kind that can do without a frame */
+    if (c->nslots || !M_isnil(c->parent))
+        env = p_frame(ctx, c->nslots, env);
+    p_push_frame(ctx, code, env);
+}
+
+/* call function or macro `fn` with the `argc` values on top of the stack (above `fn` itself) */
+static void p_enter(Fl_Context *ctx, Fl_Object *fn, int argc) {
+    Fl_Vm *vm = ctx->vm;
+    Fl_Object *code = M_rest(M_rest(fn));
+    Fl_Code *c = p_compile(ctx, code);
+    Fl_Object *env = p_frame(ctx, c->nslots, M_first(M_rest(fn)));
+    Fl_Object **slots = M_frame(env)->slots, **argv = &vm->stack[vm->sp - argc];
+
+    memcpy(slots, argv, (argc < c->nparams ? argc : c->nparams) * sizeof(*slots));
+    if (c->rest && argc > c->nparams) {
+        slots[c->nparams] = Fl_list(ctx, argv + c->nparams, argc - c->nparams);
+        M_barrier(ctx, env);
+    }
+    vm->sp -= argc + 1; /* drop the callee and its arguments */
+    p_push_frame(ctx, code, env);
+}
+
+static Fl_Object *p_missing(Fl_Context *ctx) {
+    Fl_error(ctx, "not enough arguments");
+    return &nil;
+}
+
+#define M_arg(I) ((I) < argc ? argv[I] : p_missing(ctx))
+
+#define arithmetic_op(op) {                          \
+        n = Fl_to_number(ctx, M_arg(0));             \
+        for (int i = 1; i < argc; ++i)               \
+            n = n op Fl_to_number(ctx, argv[i]);     \
+        res = Fl_T_number(ctx, n);                   \
+    }
+
+/* the slot of vector `vec` number `i` stands for */
+static Fl_Object **p_vec_slot(Fl_Context *ctx, Fl_Object *vec, Fl_Object *i) {
+    Fl_Vector *v = M_vector(Fl_check_type(ctx, vec, T_VECTOR));
+    Fl_Number n = Fl_to_number(ctx, i);
+    if (!(n >= 0 && n < v->len) || n != (size_t)n)
+        Fl_error(ctx, "vector index is out of range");
+    return &v->items[(size_t)n];
+}
+
+#define relational_op(op)                                                  \
+        n = M_number(Fl_check_type(ctx, M_arg(0), T_NUMBER));              \
+        res = Fl_T_bool(ctx, n op M_number(Fl_check_type(ctx, M_arg(1), T_NUMBER)));
+
+/* built-ins that evaluate all of their arguments, the rest are compiled inline */
+static Fl_Object *p_builtin(Fl_Context *ctx, int id, Fl_Object **argv, int argc) {
+    Fl_Object *res = &nil;
+    Fl_Number n;
+
+    switch (id) {
+    case BI_USE: {
+        char file_name[MAX_BUF_LEN * 16]; /* 1KB, a pretty sensible buffer size */
+        Fl_to_string(ctx, Fl_check_type(ctx, M_arg(0), T_STRING), file_name, sizeof(file_name));
+        FILE *fp = fopen(file_name, "r");
+        if (!fp)
+            Fl_error(ctx, "could not load file");
+        Fl_run_file(ctx, fp);
+        break;
+    }
+    case BI_TYPE:
+        res = Fl_T_string(ctx, Fl_type_name(Fl_type(ctx, M_arg(0))));
+        break;
+    case BI_CONS:
+        res = Fl_T_cons(ctx, M_arg(0), M_arg(1));
+        break;
+    case BI_FIRST:
+        res = Fl_first(ctx, M_arg(0));
+        break;
+    case BI_REST:
+        res = Fl_rest(ctx, M_arg(0));
+        break;
+    case BI_SETF:
+        M_first(Fl_check_type(ctx, M_arg(0), T_PAIR)) = M_arg(1);
+        M_barrier(ctx, argv[0]);
+        break;
+    case BI_SETR:
+        M_rest(Fl_check_type(ctx, M_arg(0), T_PAIR)) = M_arg(1);
+        M_barrier(ctx, argv[0]);
+        break;
+    case BI_LIST:
+        res = Fl_list(ctx, argv, argc);
+        break;
+    case BI_NOT:
+        res = Fl_T_bool(ctx, M_isnil(M_arg(0)));
+        break;
+    case BI_ATOM:
+        res = Fl_T_bool(ctx, Fl_type(ctx, M_arg(0)) != T_PAIR);
+        break;
+    case BI_PRINT:
+        for (int i = 0; i < argc; ++i) {
+            Fl_writefp(ctx, argv[i], stdout);
+            if (i + 1 < argc)
+                fputs(" ", stdout);
+        }
+        break;
+    case BI_EQ:
+        res = Fl_T_bool(ctx, Fl_equal(ctx, M_arg(0), M_arg(1)));
+        break;
+    case BI_LT:
+        relational_op(<);
+        break;
+    case BI_LE:
+        relational_op(<=);
+        break;
+    case BI_GT:
+        relational_op(>);
+        break;
+    case BI_GE:
+        relational_op(>=);
+        break;
+    case BI_ADD:
+        arithmetic_op(+);
+        break;
+    case BI_SUB:
+        arithmetic_op(-);
+        break;
+    case BI_MUL:
+        arithmetic_op(*);
+        break;
+    case BI_DIV:
+        arithmetic_op(/);
+        break;
+    case BI_VECTOR:
+        res = Fl_T_vector(ctx, argv, argc);
+        break;
+    case BI_VREF:
+        res = *p_vec_slot(ctx, M_arg(0), M_arg(1));
+        break;
+    case BI_VSET:
+        *p_vec_slot(ctx, M_arg(0), M_arg(1)) = M_arg(2);
+        M_barrier(ctx, argv[0]);
+        break;
+    case BI_VLEN:
+        res = Fl_T_number(ctx, M_vector(Fl_check_type(ctx, M_arg(0), T_VECTOR))->len);
+        break;
+    case BI_VPUSH:
+        Fl_vec_push(ctx, Fl_check_type(ctx, M_arg(0), T_VECTOR), M_arg(1));
+        res = argv[0];
+        break;
+    case BI_LIST2VEC: {
+        res = Fl_T_vector(ctx, NULL, 0);
+        for (Fl_Object *l = M_arg(0); !M_isnil(l); l = M_rest(l))
+            Fl_vec_push(ctx, res, M_first(Fl_check_type(ctx, l, T_PAIR)));
+        break;
+    }
+    case BI_VEC2LIST: {
+        Fl_Vector *v = M_vector(Fl_check_type(ctx, M_arg(0), T_VECTOR));
+        res = Fl_list(ctx, v->items, v->len);
+        break;
+    }
+    case BI_MAPNEW:
+        res = Fl_Map_make(ctx);
+        break;
+    case BI_MAPGET:
+        if (!(res = Fl_Map_get(ctx, Fl_check_type(ctx, M_arg(0), T_MAP), M_arg(1))))
+            res = argc > 2 ? argv[2] : &nil;
+        break;
+    case BI_MAPSET:
+        Fl_Map_set(ctx, Fl_check_type(ctx, M_arg(0), T_MAP), M_arg(1), M_arg(2));
+        break;
+    case BI_MAPDEL:
+        res = Fl_T_bool(ctx, Fl_Map_del(ctx, Fl_check_type(ctx, M_arg(0), T_MAP), M_arg(1)));
+        break;
+    case BI_MAPKEYS: {
+        Fl_Object *map = Fl_check_type(ctx, M_arg(0), T_MAP), *key, *value;
+        for (size_t i = 0; Fl_Map_next(map, &i, &key, &value);)
+            res = Fl_T_cons(ctx, key, res);
+        break;
+    }
+    case BI_MAPLEN:
+        res = Fl_T_number(ctx, Fl_Map_len(Fl_check_type(ctx, M_arg(0), T_MAP)));
+        break;
+    }
+    return res;
+}
+
+/*
+ * compiled code for a call site whose callee turned out to be a macro or special form at run
+ * time, `at` points to the site's scope and form operands
+ */
+static Fl_Object *p_late_expansion(Fl_Context *ctx, Fl_Object *parent, const int *at, Fl_Object *fn) {
+    Fl_Object **k = M_code(parent)->consts;
+    int site = at[2];
+    Fl_Object *cache = k[site + 1], *form = k[site];
+    if (!M_isnil(cache) && M_first(cache) == fn)
+        return M_rest(cache);
+    if (M_type(fn) == T_MACRO)
+        form = p_expand(ctx, fn, M_rest(form));
+    else /* special form reached through a variable, compile it as if it was called directly */
+        form = Fl_T_cons(ctx, fn, M_rest(form));
+    Fl_Object *code = Fl_Code_make(ctx, &nil, form);
+    Fl_Code *c = M_code(code);
+    c->expr = true;
+    c->parent = parent;
+    c->parent_decl = at[0];
+    c->parent_level = at[1];
+    p_compile(ctx, code);
+    k[site + 1] = Fl_T_cons(ctx, fn, code);
+    M_barrier(ctx, parent);
+    return code;
+}
+
+static void p_raise(Fl_Context *ctx, Fl_Object *message) {
+    char buf[MAX_BUF_LEN * 2];
+    Fl_to_string(ctx, message, buf, sizeof(buf));
+    Fl_error(ctx, buf);
+}
+
+#ifdef FL_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* run until the activation at depth `floor` returns, and return its value */
+static Fl_Object *p_run(Fl_Context *ctx, int floor) {
+    Fl_Vm *vm = ctx->vm;
+    Fl_Activation *fr;
+    Fl_Code *c;
+    Fl_Cache *cache;
+    Fl_Object **k, **sp, *env, *x;
+    int *ops, pc, n, gc = Fl_Gc_save(ctx);
+
+/* registers <-> vm state, SYNC before anything that may collect or run code */
+#define SYNC()   (vm->sp = sp - vm->stack)
+#define RELOAD() (sp = vm->stack + vm->sp, fr = &vm->frames[vm->depth - 1])
+#define ENTER()  (RELOAD(), c = M_code(fr->code), ops = c->ops, k = c->consts, pc = fr->pc, env = fr->env)
+
+#ifdef FL_COMPUTED_GOTO
+#define M_label(OP, OPERANDS) &&L_##OP,
+#define CASE(OP)    L_##OP:
+#define NEXT()      goto *dispatch[ops[pc++]]
+    static const void *const dispatch[OP_LEN] = { VM_OPCODES(M_label) };
+    ENTER();
+    NEXT();
+#else
+#define CASE(OP)    case OP:
+#define NEXT()      continue
+    ENTER();
+    for (;;) switch (ops[pc++]) {
+#endif
+
+    CASE(OP_NIL)
+        *sp++ = &nil;
+        NEXT();
+    CASE(OP_CONST)
+        *sp++ = k[ops[pc++]];
+        NEXT();
+    CASE(OP_LOCAL)
+        *sp++ = M_frame(env)->slots[ops[pc++]];
+        NEXT();
+    CASE(OP_UPVAL)
+        for (x = env, n = ops[pc++]; n; --n)
+            x = M_frame(x)->parent;
+        *sp++ = M_frame(x)->slots[ops[pc++]];
+        NEXT();
+    CASE(OP_GLOBAL)
+        *sp++ = M_symvalue(k[ops[pc++]]);
+        NEXT();
+    CASE(OP_SETLOCAL)
+        M_frame(env)->slots[ops[pc++]] = sp[-1];
+        M_barrier(ctx, env);
+        sp[-1] = &nil;
+        NEXT();
+    CASE(OP_SETUPVAL)
+        for (x = env, n = ops[pc++]; n; --n)
+            x = M_frame(x)->parent;
+        M_frame(x)->slots[ops[pc++]] = sp[-1];
+        M_barrier(ctx, x);
+        sp[-1] = &nil;
+        NEXT();
+    CASE(OP_SETGLOBAL)
+        Fl_set(ctx, k[ops[pc++]], sp[-1]);
+        sp[-1] = &nil;
+        NEXT();
+    CASE(OP_BIND)
+        M_frame(env)->slots[ops[pc++]] = *--sp;
+        M_barrier(ctx, env);
+        NEXT();
+    CASE(OP_POP)
+        --sp;
+        NEXT();
+    CASE(OP_JUMP)
+        pc = ops[pc];
+        /* loops come back here, so sampling can't wait for a call */
+        if (vm->sample)
+            Fl_Prof_sample(ctx, vm->depth - 1);
+        NEXT();
+    CASE(OP_JUMPNIL)
+        pc = M_isnil(*--sp) ? ops[pc] : pc + 1;
+        NEXT();
+    CASE(OP_AND)
+        if (M_isnil(sp[-1])) {
+            pc = ops[pc];
+        } else {
+            --sp;
+            ++pc;
+        }
+        NEXT();
+    CASE(OP_OR)
+        if (!M_isnil(sp[-1])) {
+            pc = ops[pc];
+        } else {
+            --sp;
+            ++pc;
+        }
+        NEXT();
+    CASE(OP_FRAME)
+        SYNC();
+        env = fr->env = p_frame(ctx, ops[pc++], env);
+        Fl_Gc_restore(ctx, gc);
+        NEXT();
+    CASE(OP_ENDFRAME)
+        env = fr->env = M_frame(env)->parent;
+        NEXT();
+    CASE(OP_FUNC)
+    CASE(OP_MACRO)
+        SYNC();
+        x = Fl_T_cons(ctx, env, k[ops[pc]]);
+        *sp = Fl_object(ctx);
+        M_settype(*sp, ops[pc - 1] == OP_FUNC ? T_FUNC : T_MACRO);
+        M_rest(*sp++) = x;
+        ++pc;
+        Fl_Gc_restore(ctx, gc);
+        NEXT();
+    CASE(OP_CALLSYM)
+        /* no callable global was bound again since the callee passed the checks below */
+        cache = &c->caches[ops[pc + 1]];
+        if (cache->version == ctx->symtab.version) {
+            *sp++ = cache->callee;
+            pc += 6;
+            NEXT();
+        }
+        x = M_symvalue(k[ops[pc]]);
+        if (p_callable(x)) {
+            cache->version = ctx->symtab.version;
+            cache->callee = x;
+        }
+        *sp++ = x;
+        pc += 2;
+        goto callee;
+    CASE(OP_CALLEE)
+    callee:
+        x = sp[-1];
+        switch (M_type(x)) {
+        case T_BUILTIN:
+            if (!p_is_special(M_builtin(x)))
+                break;
+            /* FALLTHROUGH */
+        case T_MACRO:
+            /* expand now, then run the expansion as if it was written at this site */
+            fr->pc = ops[pc];
+            SYNC();
+            x = p_late_expansion(ctx, fr->code, &ops[pc + 1], x);
+            --vm->sp;
+            p_activate(ctx, x, env);
+            ENTER();
+            Fl_Gc_restore(ctx, gc);
+            NEXT();
+        case T_FUNC:
+        case T_CFUNC:
+            break;
+        default:
+            fr->pc = pc + 4;
+            SYNC();
+            Fl_error(ctx, "cannot call non-callable value");
+        }
+        pc += 4;
+        NEXT();
+    CASE(OP_TAILCALL)
+        n = ops[pc];
+        x = sp[-n - 1];
+        if (M_type(x) != T_FUNC)
+            goto call; /* a built-in returns right away anyway */
+        /* nothing is left to do here, the callee takes over this activation */
+        memmove(vm->stack + fr->bp, sp - n - 1, (n + 1) * sizeof(*sp));
+        vm->sp = fr->bp + n + 1;
+        if (--vm->depth <= vm->frozen)
+            vm->frozen = vm->depth ? vm->depth - 1 : 0;
+        p_enter(ctx, x, n);
+        ENTER();
+        Fl_Gc_restore(ctx, gc);
+        NEXT();
+    CASE(OP_BUILTIN)
+        cache = &c->caches[ops[pc + 1]];
+        n = ops[pc + 2];
+        if (cache->version == ctx->symtab.version) {
+            x = cache->callee;
+        } else if (M_type(x = M_symvalue(k[ops[pc]])) != T_BUILTIN || p_is_special(M_builtin(x))) {
+            /* the symbol was bound to something else since, call that the usual way */
+            if (M_type(x) == T_BUILTIN || M_type(x) == T_MACRO) {
+                fr->pc = pc + 4;
+                SYNC();
+                Fl_error(ctx, "built-in was redefined as a macro after this call was compiled");
+            }
+            memmove(sp - n + 1, sp - n, n * sizeof(*sp));
+            sp[-n] = x;
+            ++sp;
+            pc += 2;
+            goto call;
+        } else {
+            cache->version = ctx->symtab.version;
+            cache->callee = x;
+        }
+        pc += 4;
+        fr->pc = pc;
+        SYNC();
+        x = p_builtin(ctx, M_builtin(x), sp - n, n);
+        RELOAD();
+        sp -= n;
+        *sp++ = x;
+        Fl_Gc_restore(ctx, gc);
+        NEXT();
+    CASE(OP_FOLD)
+        /* the built-ins the result was worked out with are still bound to the same symbols, which
+           holds for sure if no callable global was bound again since it last did */
+        cache = &c->caches[ops[pc]];
+        if (cache->version == ctx->symtab.version || p_guard(k[ops[pc + 1]])) {
+            cache->version = ctx->symtab.version;
+            *sp++ = k[ops[pc + 2]];
+            pc += ops[pc + 3];
+        }
+        pc += 4;
+        NEXT();
+    CASE(OP_CALL)
+    call:
+        n = ops[pc];
+        pc += 2;
+        x = sp[-n - 1];
+        fr->pc = pc;
+        SYNC();
+        switch (M_type(x)) {
+        case T_FUNC:
+            p_enter(ctx, x, n);
+            ENTER();
+            Fl_Gc_restore(ctx, gc);
+            NEXT();
+        case T_BUILTIN:
+            x = p_builtin(ctx, M_builtin(x), sp - n, n);
+            break;
+        case T_CFUNC:
+            x = M_cfunc(x)(ctx, Fl_list(ctx, sp - n, n));
+            break;
+        default:
+            Fl_error(ctx, "cannot call non-callable value");
+        }
+        RELOAD();
+        /* time spent in C is the call site's */
+        if (vm->sample)
+            Fl_Prof_sample(ctx, vm->depth);
+        sp -= n + 1;
+        *sp++ = x;
+        Fl_Gc_restore(ctx, gc);
+        NEXT();
+    CASE(OP_RETURN)
+        x = sp[-1];
+        vm->sp = fr->bp;
+        if (--vm->depth <= vm->frozen)
+            vm->frozen = vm->depth ? vm->depth - 1 : 0;
+        if (vm->depth == floor)
+            return x;
+        ENTER();
+        *sp++ = x;
+        NEXT();
+    CASE(OP_ERROR)
+        fr->pc = pc + 2;
+        SYNC();
+        p_raise(ctx, k[ops[pc]]);
+        NEXT();
+
+#ifndef FL_COMPUTED_GOTO
+    }
+#endif
+}
+
+#ifdef FL_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+static Fl_Object *p_expand(Fl_Context *ctx, Fl_Object *macro, Fl_Object *args) {
+    Fl_Vm *vm = ctx->vm;
+    int floor = vm->depth, argc = 0;
+    p_reserve(ctx, 1);
+    vm->stack[vm->sp++] = macro;
+    for (; M_type(args) == T_PAIR; args = M_rest(args), ++argc) {
+        p_reserve(ctx, 1);
+        vm->stack[vm->sp++] = M_first(args);
+    }
+    if (!M_isnil(args))
+        Fl_check_type(ctx, args, T_PAIR);
+    p_enter(ctx, macro, argc);
+    Fl_Object *res = p_run(ctx, floor);
+    Fl_Gc_push(ctx, res);
+    return res;
+}
+
+Fl_Object *Fl_exec(Fl_Context *ctx, Fl_Object *code) {
+    int floor = ctx->vm->depth;
+    p_compile(ctx, Fl_check_type(ctx, code, T_CODE));
+    p_activate(ctx, code, &nil);
+    Fl_Object *res = p_run(ctx, floor);
+    Fl_Gc_push(ctx, res);
+    return res;
+}
+
+/* call `fn` with the `argc` objects at `argv`, a function gets them straight in its frame */
+Fl_Object *Fl_call(Fl_Context *ctx, Fl_Object *fn, Fl_Object **argv, int argc) {
+    Fl_Vm *vm = ctx->vm;
+    int floor = vm->depth, base = vm->sp;
+    Fl_Object *res = &nil;
+    p_reserve(ctx, argc + 1);
+    vm->stack[vm->sp++] = fn;
+    for (int i = 0; i < argc; ++i)
+        vm->stack[vm->sp++] = argv[i];
+    switch (M_type(fn)) {
+    case T_FUNC:
+        p_enter(ctx, fn, argc);
+        res = p_run(ctx, floor);
+        break;
+    case T_CFUNC:
+        res = M_cfunc(fn)(ctx, Fl_list(ctx, &vm->stack[base + 1], argc));
+        break;
+    case T_BUILTIN:
+        if (!p_is_special(M_builtin(fn))) {
+            res = p_builtin(ctx, M_builtin(fn), &vm->stack[base + 1], argc);
+            break;
+        }
+        /* FALLTHROUGH */
+    default:
+        Fl_error(ctx, "cannot call non-callable value");
+    }
+    vm->sp = base;
+    Fl_Gc_push(ctx, res);
+    return res;
+}
+
+void Fl_Vm_init(Fl_Context *ctx) {
+    Fl_Vm *vm = calloc(1, sizeof(Fl_Vm));
+    if (vm) {
+        vm->stack_cap = 256;
+        vm->frames_cap = 64;
+        vm->stack = malloc(vm->stack_cap * sizeof(*vm->stack));
+        vm->frames = malloc(vm->frames_cap * sizeof(*vm->frames));
+    }
+    if (!vm || !vm->stack || !vm->frames)
+        Fl_error(ctx, "could not allocate the virtual machine");
+    ctx->vm = vm;
+}
+
+void Fl_Vm_free(Fl_Context *ctx) {
+    Fl_Vm *vm = ctx->vm;
+    if (!vm)
+        return;
+    free(vm->stack);
+    free(vm->frames);
+    free(vm->trace);
+    for (int i = 0; i < VM_POOL_SIZES; ++i) {
+        while (vm->pool[i]) {
+            Fl_Frame *f = vm->pool[i];
+            vm->pool[i] = (Fl_Frame *)f->parent;
+            free(f);
+        }
+    }
+    free(vm);
+    ctx->vm = NULL;
+}
+
+void Fl_Vm_mark(Fl_Context *ctx) {
+    Fl_Vm *vm = ctx->vm;
+    if (!vm)
+        return;
+    /* what frozen activations hold was already marked, and promoted, by the previous collection */
+    int from = ctx->heap.full ? 0 : vm->frozen;
+    for (int i = from ? vm->frames[from].bp : 0; i < vm->sp; ++i)
+        Fl_Gc_mark(ctx, vm->stack[i]);
+    for (int i = from; i < vm->depth; ++i) {
+        Fl_Gc_mark(ctx, vm->frames[i].code);
+        Fl_Gc_mark(ctx, vm->frames[i].env);
+    }
+    vm->frozen = vm->depth ? vm->depth - 1 : 0;
+}
+
+Fl_Object *Fl_Vm_unwind(Fl_Context *ctx) {
+    Fl_Vm *vm = ctx->vm;
+    Fl_Object *cl = &nil;
+    if (!vm)
+        return cl;
+    if (vm->depth > vm->trace_cap) {
+        Fl_Object *trace = realloc(vm->trace, vm->depth * sizeof(*trace));
+        if (trace) {
+            vm->trace = trace;
+            vm->trace_cap = vm->depth;
+        }
+    }
+    /* innermost call site first, like a stack of nested calls */
+    for (int i = 0; i < vm->depth && i < vm->trace_cap; ++i) {
+        Fl_Activation *fr = &vm->frames[i];
+        Fl_Code *c = M_code(fr->code);
+        if (!fr->pc)
+            continue;
+        M_first(&vm->trace[i]) = c->consts[c->ops[fr->pc - 1]];
+        M_rest(&vm->trace[i]) = cl;
+        cl = &vm->trace[i];
+    }
+    vm->sp = vm->depth = vm->frozen = 0;
+    ++vm->epoch;
+    return cl;
+}
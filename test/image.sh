@@ -0,0 +1,58 @@
+#!/bin/sh
+# Heap images: the test scripts give the same output started from an image as from base.fl, and an
+# image that is truncated, or was made by another build or layout, is refused for base.fl.
+# Usage: test/image.sh path/to/flamingo
+set -u
+
+bin=$(cd "$(dirname "${1:?usage: $0 path/to/flamingo}")" && pwd)/$(basename "$1")
+tests=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tests/../lib" || exit 1
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+"$bin" -o "$tmp/good.img" </dev/null || { echo "FAIL: could not save an image"; exit 1; }
+
+for f in "$tests"/*.fl; do
+    "$bin" "$f" </dev/null >"$tmp/plain.out" 2>&1
+    "$bin" -i "$tmp/good.img" "$f" </dev/null >"$tmp/image.out" 2>&1
+    cmp -s "$tmp/plain.out" "$tmp/image.out" || fail "$(basename "$f") runs differently from the image"
+done
+
+# the image is refused with a warning, and the library is loaded instead (println is in base.fl)
+refused() {
+    "$bin" -i "$tmp/$1.img" -s '(println (+ 1 2))' </dev/null >"$tmp/out" 2>"$tmp/err"
+    grep -q "can't be used" "$tmp/err" || fail "$1 image was not refused"
+    [ "$(head -n 1 "$tmp/out")" = 3 ] || fail "$1 image did not fall back to base.fl"
+}
+
+size=$(wc -c <"$tmp/good.img")
+head -c $((size / 2)) "$tmp/good.img" >"$tmp/truncated.img"
+refused truncated
+
+: >"$tmp/empty.img"
+refused empty
+
+# the build stamp follows the 8 byte magic, the layout the 48 byte stamp
+cp "$tmp/good.img" "$tmp/build.img"
+printf 'another build' | dd of="$tmp/build.img" bs=1 seek=8 conv=notrunc 2>/dev/null
+refused build
+
+cp "$tmp/good.img" "$tmp/layout.img"
+printf '\001\002\003\004\005\006\007\010' | dd of="$tmp/layout.img" bs=1 seek=56 conv=notrunc 2>/dev/null
+refused layout
+
+cp "$tmp/good.img" "$tmp/magic.img"
+printf 'NOTANIMG' | dd of="$tmp/magic.img" bs=1 seek=0 conv=notrunc 2>/dev/null
+refused magic
+
+"$bin" -i "$tmp/missing.img" -s '(println (+ 1 2))' </dev/null >"$tmp/out" 2>"$tmp/err"
+grep -q "can't be used" "$tmp/err" && [ "$(head -n 1 "$tmp/out")" = 3 ] || fail "missing image"
+
+[ $failed = 0 ] && echo "all image checks passed"
+exit $failed